@@ -9,16 +9,36 @@
  * 
  */
 
+#include <errno.h>
+#include <limits.h>
 #include <getopt.h>
+#include <math.h>
+#include <netdb.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <tuple>
 #include <vector>
 
 #include <nvml.h>
@@ -36,13 +56,86 @@ typedef enum {
 
 static LogLevel current_loglevel = LOG_INFO;
 
-void log_printf(LogLevel level, const char *fmt, va_list args) {
-	FILE *out = stdout;
+/* Captured log line, replayed later in a deterministic order */
+struct LogRecord {
+	LogLevel level;
+	std::string message;
+};
 
-	if (level < current_loglevel) {
-		return;
+// When set, log lines of this thread are captured instead of printed
+static thread_local std::vector<LogRecord> *log_capture = NULL;
+
+/* Bounded multi-producer, single consumer queue of formatted log lines.
+ * Each slot carries a sequence number telling producers and the consumer
+ * whose turn it is, so neither side ever waits on the other. */
+class LogRing {
+public:
+	static constexpr unsigned int capacity = 1024;
+	static constexpr unsigned int line_size = 256;
+
+	LogRing() {
+		for(unsigned int i = 0; i < capacity; i++) {
+			slots[i].sequence.store(i, std::memory_order_relaxed);
+		}
+	}
+
+	// Format into a free slot, false when full. Long lines are truncated.
+	bool push(LogLevel level, const char *fmt, va_list args) {
+		size_t pos = write_pos.load(std::memory_order_relaxed);
+		Slot *slot;
+		for(;;) {
+			slot = &slots[pos & (capacity - 1)];
+			long long lag = (long long)slot->sequence.load(std::memory_order_acquire) - (long long)pos;
+			if(lag == 0) {
+				if(write_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					break;
+				}
+			} else if(lag < 0) {
+				return false;
+			} else {
+				pos = write_pos.load(std::memory_order_relaxed);
+			}
+		}
+		slot->level = level;
+		vsnprintf(slot->text, line_size, fmt, args);
+		slot->sequence.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Hand the oldest line to fn, false when empty. Consumer thread only.
+	template <typename F>
+	bool pop(F fn) {
+		Slot *slot = &slots[read_pos & (capacity - 1)];
+		if(slot->sequence.load(std::memory_order_acquire) != read_pos + 1) {
+			return false;
+		}
+		fn(slot->level, slot->text);
+		slot->sequence.store(read_pos + capacity, std::memory_order_release);
+		read_pos++;
+		return true;
 	}
 
+private:
+	struct Slot {
+		std::atomic<size_t> sequence;
+		LogLevel level;
+		char text[line_size];
+	};
+
+	Slot slots[capacity];
+	alignas(64) std::atomic<size_t> write_pos{0};
+	alignas(64) size_t read_pos = 0;
+};
+
+static LogRing log_ring;
+// Once set, log lines are queued for the drain thread instead of written in place
+static std::atomic<bool> log_async(false);
+static std::atomic<unsigned long long> log_dropped(0);
+
+// Print level prefix, returns the stream the message goes to
+FILE *log_prefix(LogLevel level) {
+	FILE *out = stdout;
+
 	switch (level) {
 	case LOG_DEBUG:
 		fprintf(stdout, "[DEBUG] ");
@@ -65,9 +158,53 @@ void log_printf(LogLevel level, const char *fmt, va_list args) {
 	default:
 		break;
 	}
+	return out;
+}
+
+void log_printf(LogLevel level, const char *fmt, va_list args) {
+	if (level < current_loglevel) {
+		return;
+	}
+
+	if (log_capture) {
+		char message[1024];
+		vsnprintf(message, sizeof(message), fmt, args);
+		log_capture->push_back({level, message});
+		return;
+	}
+
+	// Never block the caller, a full queue drops the line
+	if (log_async.load(std::memory_order_relaxed)) {
+		if(!log_ring.push(level, fmt, args)) {
+			log_dropped.fetch_add(1, std::memory_order_relaxed);
+		}
+		return;
+	}
+
+	// Keep lines from concurrent threads whole
+	FILE *out = level >= LOG_WARN ? stderr : stdout;
+	flockfile(out);
+	log_prefix(level);
 	vfprintf(out, fmt, args);
 	fprintf(out, "\n");
 	fflush(out);
+	funlockfile(out);
+}
+
+// Write a formatted line, the caller flushes
+void log_write(LogLevel level, const char *message) {
+	FILE *out = level >= LOG_WARN ? stderr : stdout;
+	flockfile(out);
+	log_prefix(level);
+	fprintf(out, "%s\n", message);
+	funlockfile(out);
+}
+
+void log_replay(const std::vector<LogRecord> &records) {
+	for(auto &record : records) {
+		log_write(record.level, record.message.c_str());
+		fflush(record.level >= LOG_WARN ? stderr : stdout);
+	}
 }
 
 void log_printf(LogLevel level, const char *fmt, ...) {
@@ -77,227 +214,5150 @@ void log_printf(LogLevel level, const char *fmt, ...) {
 	va_end(args);
 }
 
-/* Powermizer instance for a GPU */
-class PowermizerInstance {
+// Nanoseconds since the steady_clock epoch
+long long monotonic_ns(std::chrono::steady_clock::time_point t) {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(t.time_since_epoch()).count();
+}
+
+// Milliseconds since the Unix epoch, comparable across processes
+long long wall_clock_ms() {
+	return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+/* Boost policy */
+typedef enum {
+	BOOST_STEP = 0,		// One power state per boost window
+	BOOST_JUMP,			// Straight to the highest power state
+	BOOST_PROPORTIONAL	// Steps scaled by utilization above the threshold
+} BoostPolicy;
+
+static const char *boost_policy_names[] = {"step", "jump", "proportional"};
+
+bool parse_boost_policy(const char *name, BoostPolicy *policy) {
+	for(unsigned int i = 0; i < sizeof(boost_policy_names) / sizeof(boost_policy_names[0]); i++) {
+		if(strcmp(name, boost_policy_names[i]) == 0) {
+			*policy = (BoostPolicy)i;
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Control policy deciding the power state */
+typedef enum {
+	POLICY_HYSTERESIS = 0,	// Boost and low power thresholds, each sustained for its time
+	POLICY_EWMA,			// Thresholds on smoothed utilization, times are minimum residency
+	POLICY_PID				// PID controller holding utilization at a target
+} ControlPolicy;
+
+static const char *control_policy_names[] = {"hysteresis", "ewma", "pid"};
+
+bool parse_control_policy(const char *name, ControlPolicy *policy) {
+	for(unsigned int i = 0; i < sizeof(control_policy_names) / sizeof(control_policy_names[0]); i++) {
+		if(strcmp(name, control_policy_names[i]) == 0) {
+			*policy = (ControlPolicy)i;
+			return true;
+		}
+	}
+	return false;
+}
+
+// Parse PID gains as "kp,ki,kd"
+bool parse_pid_gains(const char *text, double gains[3]) {
+	char *end;
+	for(int i = 0; i < 3; i++) {
+		gains[i] = strtod(text, &end);
+		if(end == text || gains[i] < 0 || *end != (i < 2 ? ',' : '\0')) {
+			return false;
+		}
+		text = end + 1;
+	}
+	return true;
+}
+
+/* How the activity of MIG instances adds up for the shared memory clock */
+typedef enum {
+	MIG_AGGREGATE_MAX = 0,	// The busiest instance decides
+	MIG_AGGREGATE_WEIGHTED	// Mean weighted by the SMs of each instance
+} MigAggregate;
+
+static const char *mig_aggregate_names[] = {"max", "weighted"};
+
+bool parse_mig_aggregate(const char *name, MigAggregate *aggregate) {
+	for(unsigned int i = 0; i < sizeof(mig_aggregate_names) / sizeof(mig_aggregate_names[0]); i++) {
+		if(strcmp(name, mig_aggregate_names[i]) == 0) {
+			*aggregate = (MigAggregate)i;
+			return true;
+		}
+	}
+	return false;
+}
+
+/* What makes two compute processes the same workload for learning */
+typedef enum {
+	LEARN_KEY_NAME = 0,	// Process name
+	LEARN_KEY_CGROUP	// Control group, e.g. the systemd unit or container
+} LearnKey;
+
+static const char *learn_key_names[] = {"name", "cgroup"};
+
+bool parse_learn_key(const char *name, LearnKey *key) {
+	for(unsigned int i = 0; i < sizeof(learn_key_names) / sizeof(learn_key_names[0]); i++) {
+		if(strcmp(name, learn_key_names[i]) == 0) {
+			*key = (LearnKey)i;
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Statistic applied to utilization history */
+typedef enum {
+	SAMPLE_STAT_NONE = 0,	// Single point sample per loop
+	SAMPLE_STAT_MEAN,
+	SAMPLE_STAT_PERCENTILE
+} SampleStat;
+
+// Parse a comma separated list of clocks in MHz
+bool parse_clock_list(const char *list, std::vector<unsigned int> &clocks) {
+	const char *p = list;
+
+	clocks.clear();
+	while(*p) {
+		char *end;
+		long value = strtol(p, &end, 10);
+		if(end == p || value <= 0 || (*end != ',' && *end != '\0')) {
+			return false;
+		}
+		clocks.push_back(value);
+		p = *end == ',' ? end + 1 : end;
+	}
+	return !clocks.empty();
+}
+
+// Accepts "mean", "max" or "p<N>" with N in 1..100
+bool parse_sample_stat(const char *name, SampleStat *stat, unsigned int *percentile) {
+	if(strcmp(name, "mean") == 0) {
+		*stat = SAMPLE_STAT_MEAN;
+		return true;
+	}
+	if(strcmp(name, "max") == 0) {
+		*stat = SAMPLE_STAT_PERCENTILE;
+		*percentile = 100;
+		return true;
+	}
+	if(name[0] == 'p') {
+		char *end;
+		long value = strtol(name + 1, &end, 10);
+		if(end != name + 1 && *end == '\0' && value >= 1 && value <= 100) {
+			*stat = SAMPLE_STAT_PERCENTILE;
+			*percentile = value;
+			return true;
+		}
+	}
+	return false;
+}
+
+unsigned int sample_value(nvmlValueType_t type, const nvmlValue_t &value) {
+	switch(type) {
+	case NVML_VALUE_TYPE_DOUBLE:
+		return (unsigned int)value.dVal;
+	case NVML_VALUE_TYPE_UNSIGNED_LONG:
+		return (unsigned int)value.ulVal;
+	case NVML_VALUE_TYPE_UNSIGNED_LONG_LONG:
+		return (unsigned int)value.ullVal;
+	case NVML_VALUE_TYPE_SIGNED_LONG_LONG:
+		return (unsigned int)value.sllVal;
+	case NVML_VALUE_TYPE_UNSIGNED_INT:
+	default:
+		return value.uiVal;
+	}
+}
+
+/* Fixed-size ring of timestamped utilization samples */
+class SampleHistory {
 public:
-	PowermizerInstance(int device_index, bool coder_enabled, 
-		unsigned int boost_util, unsigned int low_power_util, unsigned int boost_time, unsigned int low_power_time) : 
-		index(device_index), en_de_coder_enabled(coder_enabled),
-		boost_utilization(boost_util), low_power_utilization(low_power_util), 
-		boost_activate_time(boost_time), low_power_activate_time(low_power_time) {
+	static constexpr unsigned int capacity = 1024;
 
-		nvmlReturn_t result;
-		// Get device handle
-		result = nvmlDeviceGetHandleByIndex(index, &device);
-		if(result != NVML_SUCCESS) {
-			log_printf(LOG_ERROR, "GPU%d: Failed to get device handle: %s", index, nvmlErrorString(result));
-			supported = false;
-			return;
+	void push(unsigned long long timestamp, unsigned int value) {
+		timestamps[head] = timestamp;
+		values[head] = value;
+		head = (head + 1) % capacity;
+		if(count < capacity) {
+			count++;
 		}
+	}
 
-		// Get device name
-		char device_name[NVML_DEVICE_NAME_BUFFER_SIZE];
-		result = nvmlDeviceGetName(device, device_name, NVML_DEVICE_NAME_BUFFER_SIZE);
-		if(result != NVML_SUCCESS) {
-			log_printf(LOG_ERROR, "GPU%d: Failed to get device name: %s", index, nvmlErrorString(result));
-			supported = false;
-			return;
+	// Timestamp of the newest sample, 0 if empty
+	unsigned long long last_timestamp() const {
+		return count > 0 ? timestamps[(head + capacity - 1) % capacity] : 0;
+	}
+
+	// Value of the newest sample, 0 if empty
+	unsigned int last_value() const {
+		return count > 0 ? values[(head + capacity - 1) % capacity] : 0;
+	}
+
+	// Apply statistic to samples within window_us of the newest one
+	bool statistic(unsigned long long window_us, SampleStat stat, unsigned int percentile, unsigned int *out) {
+		unsigned long long newest = last_timestamp();
+		unsigned int n = 0;
+		unsigned long long sum = 0;
+
+		for(unsigned int i = 0; i < count; i++) {
+			unsigned int pos = (head + capacity - 1 - i) % capacity;
+			if(newest - timestamps[pos] > window_us) {
+				break;
+			}
+			scratch[n++] = values[pos];
+			sum += values[pos];
+		}
+		if(n == 0) {
+			return false;
 		}
 
-		// Get PCI info
-		nvmlPciInfo_t pci_info;
-		result = nvmlDeviceGetPciInfo(device, &pci_info);
-		if(result != NVML_SUCCESS) {
-			log_printf(LOG_ERROR, "GPU%d: Failed to get PCI info: %s", index, nvmlErrorString(result));
-			supported = false;
-			return;
+		if(stat == SAMPLE_STAT_MEAN) {
+			*out = sum / n;
+		} else {
+			// Nearest-rank percentile
+			unsigned int rank = (percentile * n + 99) / 100;
+			unsigned int *nth = scratch + (rank > 0 ? rank - 1 : 0);
+			std::nth_element(scratch, nth, scratch + n);
+			*out = *nth;
 		}
+		return true;
+	}
 
-		log_printf(LOG_INFO, "GPU%d: %s (%s) initializing", index, device_name, pci_info.busIdLegacy);
+private:
+	unsigned long long timestamps[capacity];
+	unsigned int values[capacity];
+	unsigned int scratch[capacity];
+	unsigned int head = 0;
+	unsigned int count = 0;
+};
 
-		// Get the max and min memory clocks
-		auto mem_clocks = std::make_unique<unsigned int[]>(10);
-		unsigned int elements = 10;
+/* Utilization inputs to a power state decision */
+struct UtilizationInputs {
+	// Max of GPU, encoder and decoder utilization, per decision window
+	unsigned int boost = 0;
+	unsigned int low_power = 0;
+	// Memory controller utilization, per decision window
+	unsigned int mem_boost = 0;
+	unsigned int mem_low_power = 0;
+	// Latest readings, 0 when not sampled
+	unsigned int gpu = 0;
+	unsigned int memory = 0;
+	unsigned int encoder = 0;
+	unsigned int decoder = 0;
+};
 
-		result = nvmlDeviceGetSupportedMemoryClocks(device, &elements, mem_clocks.get());
-		if(result != NVML_SUCCESS) {
-			log_printf(LOG_ERROR, "GPU%d: Failed to get supported memory clocks: %s", index, nvmlErrorString(result));
-			supported = false;
-			return;
+/* Fixed-size single producer, single consumer queue */
+template <typename T, size_t Capacity>
+class SpscRing {
+	static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+public:
+	// Producer side, false when full
+	bool push(const T &item) {
+		size_t write = write_index.load(std::memory_order_relaxed);
+		if(write - read_index.load(std::memory_order_acquire) == Capacity) {
+			return false;
 		}
+		items[write & (Capacity - 1)] = item;
+		write_index.store(write + 1, std::memory_order_release);
+		return true;
+	}
 
-		log_printf(LOG_DEBUG, "GPU%d: Supported memory clocks:", index);
-		for(unsigned int i = 0; i < elements; i++) {
-			log_printf(LOG_DEBUG, "GPU%d: %d MHz", index, mem_clocks[i]);
+	// Consumer side, false when empty
+	bool pop(T &item) {
+		size_t read = read_index.load(std::memory_order_relaxed);
+		if(read == write_index.load(std::memory_order_acquire)) {
+			return false;
+		}
+		item = items[read & (Capacity - 1)];
+		read_index.store(read + 1, std::memory_order_release);
+		return true;
+	}
+
+private:
+	T items[Capacity];
+	alignas(64) std::atomic<size_t> write_index{0};
+	alignas(64) std::atomic<size_t> read_index{0};
+};
+
+/* Trace file format: a TraceFileHeader followed by fixed-width records in host byte order */
+static const char trace_file_magic[8] = {'P', 'M', 'T', 'R', 'A', 'C', 'E', '\0'};
+
+struct TraceFileHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+};
+
+struct TraceRecord {
+	uint64_t time_us;       // Wall clock, microseconds since the epoch
+	uint32_t power_mw;      // Board power draw, 0 if not available
+	uint16_t gpu_index;
+	uint16_t mem_clock;     // Applied memory clock in MHz
+	uint8_t gpu;            // Utilization in percent
+	uint8_t memory;
+	uint8_t encoder;
+	uint8_t decoder;
+	uint8_t power_state;
+	uint8_t reserved[3];
+};
+static_assert(sizeof(TraceRecord) == 24, "Trace records are fixed width");
+
+/* Per-GPU queue of records, filled from the sampling path without blocking */
+struct TraceChannel {
+	SpscRing<TraceRecord, 4096> ring;
+	std::atomic<unsigned long long> dropped{0};
+
+	void record(const TraceRecord &entry) {
+		if(!ring.push(entry)) {
+			dropped.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+};
+
+/* Locked graphics clock range of a power state */
+struct ClockRange {
+	unsigned int min;
+	unsigned int max;
+};
+
+/* NVML calls made while processing, timed for metrics */
+typedef enum {
+	NVML_CALL_UTILIZATION = 0,
+	NVML_CALL_ENCODER,
+	NVML_CALL_DECODER,
+	NVML_CALL_SAMPLES,
+	NVML_CALL_CLOCK_INFO,
+	NVML_CALL_SET_MEM_CLOCKS,
+	NVML_CALL_SET_GPU_CLOCKS,
+	NVML_CALL_PROCESSES,
+	NVML_CALL_POWER,
+	NVML_CALL_GPM_MIG_SAMPLE,
+	NVML_CALL_GPM_SAMPLE,
+	NVML_CALL_FIELD_VALUES,
+	NVML_CALL_TEMPERATURE,
+	NVML_CALL_COUNT
+} NvmlCall;
+
+static const char *nvml_call_names[NVML_CALL_COUNT] = {
+	"nvmlDeviceGetUtilizationRates",
+	"nvmlDeviceGetEncoderUtilization",
+	"nvmlDeviceGetDecoderUtilization",
+	"nvmlDeviceGetSamples",
+	"nvmlDeviceGetClockInfo",
+	"nvmlDeviceSetMemoryLockedClocks",
+	"nvmlDeviceSetGpuLockedClocks",
+	"nvmlDeviceGetComputeRunningProcesses",
+	"nvmlDeviceGetPowerUsage",
+	"nvmlGpmMigSampleGet",
+	"nvmlGpmSampleGet",
+	"nvmlDeviceGetFieldValues",
+	"nvmlDeviceGetTemperature"
+};
+
+/* Transition directions */
+typedef enum {
+	TRANSITION_NONE = -1,
+	TRANSITION_BOOST = 0,
+	TRANSITION_LOWER,
+	TRANSITION_COUNT
+} Transition;
+
+static const char *transition_names[TRANSITION_COUNT] = {"boost", "lower"};
+
+/* Fixed-bucket histogram of durations in microseconds, lock-free */
+class LatencyHistogram {
+public:
+	static constexpr unsigned int bucket_count = 14;
+
+	LatencyHistogram(const unsigned long long *upper_bounds_us) : bounds(upper_bounds_us) {}
+
+	void observe(unsigned long long us) {
+		unsigned int i = 0;
+		while(i < bucket_count && us > bounds[i]) {
+			i++;
+		}
+		buckets[i].fetch_add(1, std::memory_order_relaxed);
+		sum_us.fetch_add(us, std::memory_order_relaxed);
+	}
+
+	const unsigned long long *bounds;
+	// Last bucket is +Inf
+	std::atomic<unsigned long long> buckets[bucket_count + 1] = {};
+	std::atomic<unsigned long long> sum_us{0};
+};
+
+// Bucket bounds for NVML calls and for threshold-to-clock delays
+static const unsigned long long nvml_call_bounds_us[LatencyHistogram::bucket_count] = {
+	10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 100000, 1000000, 10000000
+};
+static const unsigned long long transition_delay_bounds_us[LatencyHistogram::bucket_count] = {
+	1000, 10000, 50000, 100000, 250000, 500000, 1000000, 2500000, 5000000,
+	10000000, 30000000, 60000000, 300000000, 600000000
+};
+
+/* Per-instance state exported by the metrics endpoint.
+ * Only written with relaxed atomics, so the sampling path never locks or allocates. */
+struct InstanceMetrics {
+	InstanceMetrics(int device_index, unsigned int states) :
+		index(device_index), state_count(states), state_time_us(new std::atomic<unsigned long long>[states]) {
+		for(unsigned int i = 0; i < states; i++) {
+			state_time_us[i] = 0;
+		}
+		for(auto &histogram : transition_delay) {
+			histogram = std::make_unique<LatencyHistogram>(transition_delay_bounds_us);
+		}
+		for(auto &histogram : nvml_latency) {
+			histogram = std::make_unique<LatencyHistogram>(nvml_call_bounds_us);
+		}
+	}
+
+	const int index;
+	const unsigned int state_count;
+	std::atomic<unsigned int> max_utilization{0};
+	std::atomic<int> power_state{0};
+	std::atomic<int> memory_clock{0};
+	// Set while the GPU has fallen off the bus or awaits a reset
+	std::atomic<bool> lost{false};
+	// Set while NVML calls on the GPU stall past the watchdog time, its readings are stale
+	std::atomic<bool> degraded{false};
+	// Power draw and energy read by the instance each tick, valid while flagged
+	std::atomic<bool> power_sampled{false};
+	std::atomic<unsigned int> power_mw{0};
+	std::atomic<bool> energy_sampled{false};
+	std::atomic<unsigned long long> energy_mj{0};
+	// GPU temperature for the governor, valid while flagged
+	std::atomic<bool> temperature_sampled{false};
+	std::atomic<unsigned int> temperature_c{0};
+	// NVML calls made and those avoided by sharing readings
+	std::atomic<unsigned long long> ticks{0};
+	std::atomic<unsigned long long> nvml_calls{0};
+	std::atomic<unsigned long long> nvml_calls_saved{0};
+	std::atomic<unsigned long long> transitions[TRANSITION_COUNT] = {};
+	std::unique_ptr<std::atomic<unsigned long long>[]> state_time_us;
+	// Time busy by the boost thresholds while below the highest power state
+	std::atomic<unsigned long long> underclocked_busy_us{0};
+	std::atomic<unsigned int> sampling_period_ms{0};
+	std::unique_ptr<LatencyHistogram> transition_delay[TRANSITION_COUNT];
+	std::unique_ptr<LatencyHistogram> nvml_latency[NVML_CALL_COUNT];
+};
+
+/* Raw timings kept while benchmarking, written by the instance's thread only */
+struct BenchSamples {
+	std::vector<unsigned int> call_us[NVML_CALL_COUNT];
+	std::vector<unsigned int> process_us;
+};
+
+/* Powermizer configuration shared by all instances */
+struct PowermizerConfig {
+	bool en_de_coder_enabled = false;
+	unsigned int boost_utilization = 0;
+	unsigned int low_power_utilization = 0;
+	unsigned int boost_activate_time = 0;
+	unsigned int low_power_activate_time = 0;
+	bool mem_enabled = false;
+	unsigned int mem_boost_utilization = 0;
+	unsigned int mem_low_power_utilization = 0;
+	BoostPolicy boost_policy = BOOST_STEP;
+	// Controllers other than hysteresis, target 0 means halfway between the thresholds
+	ControlPolicy control_policy = POLICY_HYSTERESIS;
+	unsigned int target_utilization = 0;
+	unsigned int smoothing_time = 1000;
+	double pid_gains[3] = {4.0, 0.5, 0.0};
+	MigAggregate mig_aggregate = MIG_AGGREGATE_MAX;
+	SampleStat sample_stat = SAMPLE_STAT_NONE;
+	unsigned int sample_percentile = 0;
+	// Pre-boost on new compute processes, grace time in ms, 0 disables
+	unsigned int predict_grace_time = 0;
+	// Memory clocks to use as power states, all supported if empty
+	std::vector<unsigned int> mem_clocks;
+	// Graphics clock locking, 0 clocks mean the highest/lowest supported
+	bool gpu_clocks_enabled = false;
+	unsigned int gpu_boost_clock = 0;
+	unsigned int gpu_low_power_clock = 0;
+	// Decide on GPM DRAM bandwidth instead of the utilization counters
+	bool gpm_enabled = false;
+	// GPUs with the same group name move between power states together
+	std::string group;
+};
+
+// Threshold not given on the command line, must come from a profile
+static const unsigned int SETTING_UNSET = UINT_MAX;
+
+bool parse_uint(const char *text, unsigned int *value) {
+	char *end;
+	unsigned long parsed = strtoul(text, &end, 10);
+	if(end == text || *end != '\0' || text[0] == '-' || parsed > 0xFFFFFFFFUL) {
+		return false;
+	}
+	*value = parsed;
+	return true;
+}
+
+// Set one of the settings that can change at runtime, named after the long options
+bool apply_config_setting(PowermizerConfig &config, const char *key, const char *value) {
+	unsigned int number = 0;
+	bool is_number = parse_uint(value, &number);
+
+	if(strcmp(key, "boost") == 0 && is_number) {
+		config.boost_utilization = number;
+	} else if(strcmp(key, "low-power") == 0 && is_number) {
+		config.low_power_utilization = number;
+	} else if(strcmp(key, "boost-time") == 0 && is_number) {
+		config.boost_activate_time = number;
+	} else if(strcmp(key, "low-power-time") == 0 && is_number) {
+		config.low_power_activate_time = number;
+	} else if((strcmp(key, "mem-boost") == 0 || strcmp(key, "mem-low-power") == 0) && strcmp(value, "off") == 0) {
+		config.mem_enabled = false;
+	} else if(strcmp(key, "mem-boost") == 0 && is_number) {
+		config.mem_enabled = true;
+		config.mem_boost_utilization = number;
+	} else if(strcmp(key, "mem-low-power") == 0 && is_number) {
+		config.mem_enabled = true;
+		config.mem_low_power_utilization = number;
+	} else if(strcmp(key, "boost-policy") == 0) {
+		return parse_boost_policy(value, &config.boost_policy);
+	} else if(strcmp(key, "policy") == 0) {
+		return parse_control_policy(value, &config.control_policy);
+	} else if(strcmp(key, "target") == 0 && is_number && number <= 100) {
+		config.target_utilization = number;
+	} else if(strcmp(key, "smoothing") == 0 && is_number && number > 0) {
+		config.smoothing_time = number;
+	} else if(strcmp(key, "pid") == 0) {
+		return parse_pid_gains(value, config.pid_gains);
+	} else if(strcmp(key, "mig") == 0) {
+		return parse_mig_aggregate(value, &config.mig_aggregate);
+	} else if(strcmp(key, "predict") == 0 && is_number) {
+		config.predict_grace_time = number;
+	} else if(strcmp(key, "coder") == 0 && (strcmp(value, "on") == 0 || strcmp(value, "off") == 0)) {
+		config.en_de_coder_enabled = strcmp(value, "on") == 0;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+// Set any setting a profile may carry, including those only read at start-up
+bool apply_profile_setting(PowermizerConfig &config, const char *key, const char *value) {
+	unsigned int number = 0;
+	bool is_number = parse_uint(value, &number);
+
+	if(strcmp(key, "mem-clocks") == 0 && strcmp(value, "all") == 0) {
+		config.mem_clocks.clear();
+	} else if(strcmp(key, "mem-clocks") == 0) {
+		return parse_clock_list(value, config.mem_clocks);
+	} else if(strcmp(key, "gpu-clocks") == 0 && (strcmp(value, "on") == 0 || strcmp(value, "off") == 0)) {
+		config.gpu_clocks_enabled = strcmp(value, "on") == 0;
+	} else if(strcmp(key, "gpu-boost-clock") == 0 && is_number) {
+		config.gpu_boost_clock = number;
+	} else if(strcmp(key, "gpu-low-power-clock") == 0 && is_number) {
+		config.gpu_low_power_clock = number;
+	} else if(strcmp(key, "gpm") == 0 && (strcmp(value, "on") == 0 || strcmp(value, "off") == 0)) {
+		config.gpm_enabled = strcmp(value, "on") == 0;
+	} else if(strcmp(key, "group") == 0) {
+		config.group = strcmp(value, "none") == 0 ? "" : value;
+	} else if(strcmp(key, "samples") == 0) {
+		if(strcmp(value, "none") == 0) {
+			config.sample_stat = SAMPLE_STAT_NONE;
+			return true;
+		}
+		return parse_sample_stat(value, &config.sample_stat, &config.sample_percentile);
+	} else {
+		return apply_config_setting(config, key, value);
+	}
+	return true;
+}
+
+// Copy the settings an instance picks up while running
+void copy_runtime_settings(PowermizerConfig &to, const PowermizerConfig &from) {
+	to.en_de_coder_enabled = from.en_de_coder_enabled;
+	to.boost_utilization = from.boost_utilization;
+	to.low_power_utilization = from.low_power_utilization;
+	to.boost_activate_time = from.boost_activate_time;
+	to.low_power_activate_time = from.low_power_activate_time;
+	to.mem_enabled = from.mem_enabled;
+	to.mem_boost_utilization = from.mem_boost_utilization;
+	to.mem_low_power_utilization = from.mem_low_power_utilization;
+	to.boost_policy = from.boost_policy;
+	to.predict_grace_time = from.predict_grace_time;
+	to.control_policy = from.control_policy;
+	to.target_utilization = from.target_utilization;
+	to.smoothing_time = from.smoothing_time;
+	std::copy(from.pid_gains, from.pid_gains + 3, to.pid_gains);
+	to.mig_aggregate = from.mig_aggregate;
+}
+
+/* Profile sections of a config file, from least to most specific */
+typedef enum {
+	PROFILE_DEFAULTS = 0,	// [defaults] or keys before the first section
+	PROFILE_MODEL,			// [model:<device name>]
+	PROFILE_PCI,			// [pci:<bus id>]
+	PROFILE_GPU				// [gpu:<index>]
+} ProfileKind;
+
+static const char *profile_kind_names[] = {"defaults", "model", "pci", "gpu"};
+
+struct ProfileSetting {
+	std::string key;
+	std::string value;
+};
+
+struct ProfileSection {
+	ProfileKind kind;
+	std::string match;
+	std::vector<ProfileSetting> settings;
+};
+
+/* Per-GPU settings from an INI style config file. Sections apply on top
+ * of the command line in order of specificity, later ones winning. */
+class ProfileSet {
+public:
+	// Parse and validate the whole file, nothing is kept on error
+	bool load(const char *file_path) {
+		FILE *file = fopen(file_path, "r");
+		if(!file) {
+			log_printf(LOG_ERROR, "Config: Failed to open %s: %s", file_path, strerror(errno));
+			return false;
+		}
+
+		std::vector<ProfileSection> loaded(1, ProfileSection{PROFILE_DEFAULTS, "", {}});
+		char line[512];
+		unsigned int line_number = 0;
+		bool ok = true;
+		while(ok && fgets(line, sizeof(line), file)) {
+			line_number++;
+			std::string text = trim(line);
+			if(text.empty() || text[0] == '#' || text[0] == ';') {
+				continue;
+			}
+
+			if(text[0] == '[') {
+				ProfileSection section;
+				if(text.back() != ']' || !parse_section_name(text.substr(1, text.size() - 2), section)) {
+					log_printf(LOG_ERROR, "Config: %s:%d: Invalid section %s", file_path, line_number, text.c_str());
+					ok = false;
+				}
+				loaded.push_back(section);
+				continue;
+			}
+
+			size_t equals = text.find('=');
+			if(equals == std::string::npos) {
+				log_printf(LOG_ERROR, "Config: %s:%d: Expected key = value", file_path, line_number);
+				ok = false;
+				continue;
+			}
+			ProfileSetting setting = {trim(text.substr(0, equals)), trim(text.substr(equals + 1))};
+			// Check the value now rather than when a GPU happens to match
+			PowermizerConfig scratch;
+			if(!apply_profile_setting(scratch, setting.key.c_str(), setting.value.c_str())) {
+				log_printf(LOG_ERROR, "Config: %s:%d: Invalid setting %s = %s", file_path, line_number,
+					setting.key.c_str(), setting.value.c_str());
+				ok = false;
+				continue;
+			}
+			loaded.back().settings.push_back(setting);
+		}
+		fclose(file);
+
+		if(ok) {
+			sections = std::move(loaded);
+		}
+		return ok;
+	}
+
+	// Apply matching sections for one GPU on top of config
+	void resolve(PowermizerConfig &config, int index, const char *name, const char *bus_id, const char *bus_id_legacy) const {
+		for(int kind = PROFILE_DEFAULTS; kind <= PROFILE_GPU; kind++) {
+			for(const ProfileSection &section : sections) {
+				if(section.kind != kind || !matches(section, index, name, bus_id, bus_id_legacy)) {
+					continue;
+				}
+				if(kind != PROFILE_DEFAULTS) {
+					log_printf(LOG_DEBUG, "GPU%d: Using profile [%s:%s]", index, profile_kind_names[kind], section.match.c_str());
+				}
+				for(const ProfileSetting &setting : section.settings) {
+					apply_profile_setting(config, setting.key.c_str(), setting.value.c_str());
+				}
+			}
+		}
+	}
+
+private:
+	static std::string trim(const std::string &text) {
+		size_t start = text.find_first_not_of(" \t\r\n");
+		if(start == std::string::npos) {
+			return "";
+		}
+		size_t end = text.find_last_not_of(" \t\r\n");
+		return text.substr(start, end - start + 1);
+	}
+
+	static bool parse_section_name(const std::string &name, ProfileSection &section) {
+		if(name == "defaults") {
+			section.kind = PROFILE_DEFAULTS;
+			return true;
+		}
+		size_t colon = name.find(':');
+		if(colon == std::string::npos || colon + 1 == name.size()) {
+			return false;
+		}
+		std::string kind = name.substr(0, colon);
+		section.match = trim(name.substr(colon + 1));
+		for(int i = PROFILE_MODEL; i <= PROFILE_GPU; i++) {
+			if(kind == profile_kind_names[i]) {
+				section.kind = (ProfileKind)i;
+				unsigned int gpu;
+				return section.kind != PROFILE_GPU || parse_uint(section.match.c_str(), &gpu);
+			}
+		}
+		return false;
+	}
+
+	static bool matches(const ProfileSection &section, int index, const char *name, const char *bus_id, const char *bus_id_legacy) {
+		switch(section.kind) {
+		case PROFILE_MODEL:
+			return section.match == name;
+		case PROFILE_PCI:
+			return strcasecmp(section.match.c_str(), bus_id) == 0 || strcasecmp(section.match.c_str(), bus_id_legacy) == 0;
+		case PROFILE_GPU:
+			return atoi(section.match.c_str()) == index;
+		case PROFILE_DEFAULTS:
+		default:
+			return true;
+		}
+	}
+
+	std::vector<ProfileSection> sections;
+};
+
+/* Where a recurring workload settled on a GPU model */
+struct LearntWorkload {
+	// Memory clock it spent the most time at
+	unsigned int mem_clock;
+	// Peak memory bandwidth as the MHz of memory clock kept busy
+	unsigned int bandwidth;
+	unsigned int runs;
+};
+
+/* Learnt workloads shared by all instances, persisted as one tab separated
+ * line per GPU model and workload class: model, class, clock, bandwidth, runs */
+class WorkloadCache {
+public:
+	// A missing file starts an empty cache, malformed lines are skipped
+	bool load(const char *file_path, LearnKey learn_key) {
+		path = file_path;
+		key = learn_key;
+		FILE *file = fopen(file_path, "r");
+		if(!file) {
+			if(errno == ENOENT) {
+				return true;
+			}
+			log_printf(LOG_ERROR, "Learn: Failed to open %s: %s", file_path, strerror(errno));
+			return false;
+		}
+
+		char line[1024];
+		unsigned int line_number = 0;
+		while(fgets(line, sizeof(line), file)) {
+			line_number++;
+			char *fields[5];
+			unsigned int count = 0;
+			char *save = NULL;
+			for(char *field = strtok_r(line, "\t\r\n", &save); field && count < 5; field = strtok_r(NULL, "\t\r\n", &save)) {
+				fields[count++] = field;
+			}
+			LearntWorkload entry;
+			if(count != 5 || !parse_uint(fields[2], &entry.mem_clock) || !parse_uint(fields[3], &entry.bandwidth) ||
+				!parse_uint(fields[4], &entry.runs)) {
+				log_printf(LOG_WARN, "Learn: %s:%d: Skipping malformed entry", file_path, line_number);
+				continue;
+			}
+			entries[{fields[0], fields[1]}] = entry;
+		}
+		fclose(file);
+		log_printf(LOG_INFO, "Learn: Loaded %zu workload(s) from %s", entries.size(), file_path);
+		return true;
+	}
+
+	// Write through a temporary file, the old cache stays intact on failure
+	bool save() {
+		std::lock_guard<std::mutex> lock(mutex);
+		if(!dirty) {
+			return true;
+		}
+		std::string temp_path = path + ".tmp";
+		FILE *file = fopen(temp_path.c_str(), "w");
+		if(!file) {
+			log_printf(LOG_ERROR, "Learn: Failed to write %s: %s", temp_path.c_str(), strerror(errno));
+			return false;
+		}
+		for(const auto &entry : entries) {
+			fprintf(file, "%s\t%s\t%u\t%u\t%u\n", entry.first.first.c_str(), entry.first.second.c_str(),
+				entry.second.mem_clock, entry.second.bandwidth, entry.second.runs);
+		}
+		bool ok = fflush(file) == 0 && fsync(fileno(file)) == 0;
+		ok = fclose(file) == 0 && ok;
+		if(!ok || rename(temp_path.c_str(), path.c_str()) != 0) {
+			log_printf(LOG_ERROR, "Learn: Failed to save %s: %s", path.c_str(), strerror(errno));
+			unlink(temp_path.c_str());
+			return false;
+		}
+		dirty = false;
+		log_printf(LOG_DEBUG, "Learn: Saved %zu workload(s) to %s", entries.size(), path.c_str());
+		return true;
+	}
+
+	bool lookup(const std::string &model, const std::string &workload, LearntWorkload *out) {
+		std::lock_guard<std::mutex> lock(mutex);
+		auto found = entries.find({model, workload});
+		if(found == entries.end()) {
+			return false;
+		}
+		*out = found->second;
+		return true;
+	}
+
+	// The latest run replaces the previous one, the workload may have changed
+	void learn(const std::string &model, const std::string &workload, unsigned int mem_clock, unsigned int bandwidth) {
+		std::lock_guard<std::mutex> lock(mutex);
+		LearntWorkload &entry = entries[{model, workload}];
+		entry.mem_clock = mem_clock;
+		entry.bandwidth = bandwidth;
+		entry.runs++;
+		dirty = true;
+	}
+
+	// Class of a running process, empty when it cannot be told, e.g. from
+	// another PID namespace or once the process has gone
+	std::string classify(unsigned int pid) const {
+		char proc_path[64];
+		char line[512];
+		std::string workload;
+		snprintf(proc_path, sizeof(proc_path), key == LEARN_KEY_CGROUP ? "/proc/%u/cgroup" : "/proc/%u/comm", pid);
+		FILE *file = fopen(proc_path, "r");
+		if(!file) {
+			return workload;
+		}
+		while(fgets(line, sizeof(line), file)) {
+			line[strcspn(line, "\r\n")] = '\0';
+			if(key == LEARN_KEY_NAME) {
+				workload = line;
+				break;
+			}
+			// hierarchy-ID:controllers:path, the unified hierarchy has ID 0 and
+			// wins over the first v1 controller, the root group tells nothing
+			char *path_part = strchr(line, ':');
+			path_part = path_part ? strchr(path_part + 1, ':') : NULL;
+			if(!path_part || strcmp(path_part + 1, "/") == 0) {
+				continue;
+			}
+			if(strncmp(line, "0::", 3) == 0) {
+				workload = path_part + 1;
+				break;
+			}
+			if(workload.empty()) {
+				workload = path_part + 1;
+			}
+		}
+		fclose(file);
+		// Keep the file format intact
+		std::replace(workload.begin(), workload.end(), '\t', ' ');
+		return workload;
+	}
+
+private:
+	std::mutex mutex;
+	std::map<std::pair<std::string, std::string>, LearntWorkload> entries;
+	std::string path;
+	LearnKey key = LEARN_KEY_NAME;
+	bool dirty = false;
+};
+
+/* Measured cost of one memory clock transition */
+struct CalibrationEntry {
+	// Time inside the set call, and until the new clock was reported
+	unsigned long long set_us;
+	unsigned long long settle_us;
+};
+
+/* Transition costs per GPU model, one tab separated line per transition:
+ * model, from clock, to clock, set call us, settle us */
+class CalibrationTable {
+public:
+	// A missing file is an empty table when calibrating, an error otherwise
+	bool load(const char *file_path, bool missing_ok) {
+		FILE *file = fopen(file_path, "r");
+		if(!file) {
+			if(missing_ok && errno == ENOENT) {
+				return true;
+			}
+			log_printf(LOG_ERROR, "Calibration: Failed to open %s: %s", file_path, strerror(errno));
+			return false;
+		}
+		char line[512];
+		unsigned int line_number = 0;
+		while(fgets(line, sizeof(line), file)) {
+			line_number++;
+			char *save;
+			char *model = strtok_r(line, "\t", &save);
+			char *from = strtok_r(NULL, "\t", &save);
+			char *to = strtok_r(NULL, "\t", &save);
+			char *set_us = strtok_r(NULL, "\t", &save);
+			char *settle_us = strtok_r(NULL, "\r\n", &save);
+			unsigned int from_clock, to_clock, set_value, settle_value;
+			if(!settle_us || !parse_uint(from, &from_clock) || !parse_uint(to, &to_clock) ||
+				!parse_uint(set_us, &set_value) || !parse_uint(settle_us, &settle_value)) {
+				log_printf(LOG_WARN, "Calibration: %s:%d: Skipping malformed entry", file_path, line_number);
+				continue;
+			}
+			entries[Key(model, from_clock, to_clock)] = CalibrationEntry{set_value, settle_value};
+		}
+		fclose(file);
+		log_printf(LOG_INFO, "Calibration: Loaded %zu transition(s) from %s", entries.size(), file_path);
+		return true;
+	}
+
+	bool save(const char *file_path) const {
+		std::string temp_path = std::string(file_path) + ".tmp";
+		FILE *file = fopen(temp_path.c_str(), "w");
+		if(!file) {
+			log_printf(LOG_ERROR, "Calibration: Failed to write %s: %s", temp_path.c_str(), strerror(errno));
+			return false;
+		}
+		for(const auto &entry : entries) {
+			fprintf(file, "%s\t%u\t%u\t%llu\t%llu\n", std::get<0>(entry.first).c_str(), std::get<1>(entry.first),
+				std::get<2>(entry.first), entry.second.set_us, entry.second.settle_us);
+		}
+		bool ok = fflush(file) == 0 && fsync(fileno(file)) == 0;
+		ok = fclose(file) == 0 && ok;
+		if(!ok || rename(temp_path.c_str(), file_path) != 0) {
+			log_printf(LOG_ERROR, "Calibration: Failed to save %s: %s", file_path, strerror(errno));
+			unlink(temp_path.c_str());
+			return false;
+		}
+		log_printf(LOG_INFO, "Calibration: Saved %zu transition(s) to %s", entries.size(), file_path);
+		return true;
+	}
+
+	// Measurements replace those of earlier runs, within a run the worst is kept
+	void record(const std::string &model, unsigned int from_clock, unsigned int to_clock, const CalibrationEntry &measured) {
+		Key key(model, from_clock, to_clock);
+		CalibrationEntry &entry = entries[key];
+		if(measured_keys.insert(key).second) {
+			entry = measured;
+		} else {
+			entry.set_us = std::max(entry.set_us, measured.set_us);
+			entry.settle_us = std::max(entry.settle_us, measured.settle_us);
+		}
+	}
+
+	bool lookup(const std::string &model, unsigned int from_clock, unsigned int to_clock, CalibrationEntry *out) const {
+		auto found = entries.find(Key(model, from_clock, to_clock));
+		if(found == entries.end()) {
+			return false;
+		}
+		*out = found->second;
+		return true;
+	}
+
+private:
+	typedef std::tuple<std::string, unsigned int, unsigned int> Key;
+	std::map<Key, CalibrationEntry> entries;
+	// Transitions measured in this run
+	std::set<Key> measured_keys;
+};
+
+/* Memory clock a previous run left locked on a GPU */
+struct HandoffEntry {
+	unsigned int mem_clock;
+	// Wall clock time of its last transition, in ms since the epoch
+	long long last_update_ms;
+};
+
+/* State handed from one run to the next when stopped by SIGTERM, one tab
+ * separated line per GPU: UUID, memory clock, time of the last transition */
+class HandoffState {
+public:
+	// Entries are taken once, the file is removed so a later start
+	// does not adopt a lock that someone else has since placed
+	bool load(const char *file_path) {
+		FILE *file = fopen(file_path, "r");
+		if(!file) {
+			if(errno == ENOENT) {
+				return true;
+			}
+			log_printf(LOG_ERROR, "Handoff: Failed to open %s: %s", file_path, strerror(errno));
+			return false;
+		}
+		char line[256];
+		while(fgets(line, sizeof(line), file)) {
+			char uuid[NVML_DEVICE_UUID_BUFFER_SIZE];
+			HandoffEntry entry;
+			if(sscanf(line, "%79s\t%u\t%lld", uuid, &entry.mem_clock, &entry.last_update_ms) == 3) {
+				entries[uuid] = entry;
+			}
+		}
+		fclose(file);
+		unlink(file_path);
+		log_printf(LOG_INFO, "Handoff: Loaded %zu GPU(s) from %s", entries.size(), file_path);
+		return true;
+	}
+
+	bool save(const char *file_path) const {
+		std::string temp_path = std::string(file_path) + ".tmp";
+		FILE *file = fopen(temp_path.c_str(), "w");
+		if(!file) {
+			log_printf(LOG_ERROR, "Handoff: Failed to write %s: %s", temp_path.c_str(), strerror(errno));
+			return false;
+		}
+		for(const auto &entry : entries) {
+			fprintf(file, "%s\t%u\t%lld\n", entry.first.c_str(), entry.second.mem_clock, entry.second.last_update_ms);
+		}
+		bool ok = fflush(file) == 0 && fsync(fileno(file)) == 0;
+		ok = fclose(file) == 0 && ok;
+		if(!ok || rename(temp_path.c_str(), file_path) != 0) {
+			log_printf(LOG_ERROR, "Handoff: Failed to save %s: %s", file_path, strerror(errno));
+			unlink(temp_path.c_str());
+			return false;
+		}
+		log_printf(LOG_INFO, "Handoff: Saved %zu GPU(s) to %s", entries.size(), file_path);
+		return true;
+	}
+
+	bool find(const std::string &uuid, HandoffEntry *out) const {
+		auto found = entries.find(uuid);
+		if(found == entries.end()) {
+			return false;
+		}
+		*out = found->second;
+		return true;
+	}
+
+	void put(const std::string &uuid, const HandoffEntry &entry) {
+		entries[uuid] = entry;
+	}
+
+private:
+	std::map<std::string, HandoffEntry> entries;
+};
+
+/* A MIG GPU instance, the compute instances inside it share its GPM counters */
+struct MigInstanceInfo {
+	unsigned int gpu_instance_id;
+	unsigned int sm_count;
+};
+
+/* NVML GPM sample buffer, freed with its owner */
+class GpmSample {
+public:
+	GpmSample() {
+		if(nvmlGpmSampleAlloc(&sample) != NVML_SUCCESS) {
+			sample = nullptr;
+		}
+	}
+
+	~GpmSample() {
+		if(sample) {
+			nvmlGpmSampleFree(sample);
+		}
+	}
+
+	GpmSample(const GpmSample &) = delete;
+	GpmSample &operator=(const GpmSample &) = delete;
+
+	nvmlGpmSample_t get() {
+		return sample;
+	}
+
+private:
+	nvmlGpmSample_t sample = nullptr;
+};
+
+/* Two GPM samples taken in turn, each new one overwrites the older */
+struct GpmSamplePair {
+	GpmSample samples[2];
+	unsigned int latest = 0;
+	bool primed = false;
+
+	bool allocated() {
+		return samples[0].get() && samples[1].get();
+	}
+
+	nvmlGpmSample_t older() {
+		return samples[latest].get();
+	}
+
+	nvmlGpmSample_t next() {
+		return samples[latest ^ 1].get();
+	}
+
+	// Call once next() holds a new sample, false while there is nothing to compare with
+	bool advance() {
+		latest ^= 1;
+		bool had_older = primed;
+		primed = true;
+		return had_older;
+	}
+};
+
+/* Device access used by the policy, mirrors the NVML calls it needs */
+class GpuDevice {
+public:
+	virtual ~GpuDevice() {}
+
+	// Clock the policy runs on
+	virtual std::chrono::steady_clock::time_point now() {
+		return std::chrono::steady_clock::now();
+	}
+
+	virtual nvmlReturn_t open(unsigned int index) = 0;
+	// Look the GPU up again after it was lost, indices may change across a reset
+	virtual nvmlReturn_t reopen(const char *uuid) = 0;
+	virtual nvmlReturn_t get_uuid(char *uuid, unsigned int length) = 0;
+	virtual nvmlReturn_t get_name(char *name, unsigned int length) = 0;
+	virtual nvmlReturn_t get_pci_info(nvmlPciInfo_t *pci) = 0;
+	virtual nvmlReturn_t get_supported_memory_clocks(unsigned int *count, unsigned int *clocks) = 0;
+	virtual nvmlReturn_t get_supported_graphics_clocks(unsigned int mem_clock, unsigned int *count, unsigned int *clocks) = 0;
+	virtual nvmlReturn_t get_clock_info(nvmlClockType_t type, unsigned int *clock) = 0;
+	virtual nvmlReturn_t set_memory_locked_clocks(unsigned int min_clock, unsigned int max_clock) = 0;
+	virtual nvmlReturn_t reset_memory_locked_clocks() = 0;
+	virtual nvmlReturn_t set_gpu_locked_clocks(unsigned int min_clock, unsigned int max_clock) = 0;
+	virtual nvmlReturn_t reset_gpu_locked_clocks() = 0;
+	virtual nvmlReturn_t get_utilization_rates(nvmlUtilization_t *utilization) = 0;
+	virtual nvmlReturn_t get_encoder_utilization(unsigned int *utilization, unsigned int *period_us) = 0;
+	virtual nvmlReturn_t get_decoder_utilization(unsigned int *utilization, unsigned int *period_us) = 0;
+	virtual nvmlReturn_t get_samples(nvmlSamplingType_t type, unsigned long long last_seen,
+		nvmlValueType_t *value_type, unsigned int *count, nvmlSample_t *samples) = 0;
+	virtual nvmlReturn_t get_compute_running_processes(unsigned int *count, nvmlProcessInfo_t *processes) = 0;
+	virtual nvmlReturn_t get_power_usage(unsigned int *power_mw) = 0;
+	virtual nvmlReturn_t get_field_values(int count, nvmlFieldValue_t *values) = 0;
+	virtual nvmlReturn_t get_enforced_power_limit(unsigned int *limit_mw) = 0;
+	virtual nvmlReturn_t get_temperature(unsigned int *temperature) = 0;
+	virtual nvmlReturn_t get_slowdown_temperature(unsigned int *temperature) = 0;
+	// Register the supported subset of the event types, which is written back
+	virtual nvmlReturn_t register_events(nvmlEventSet_t set, unsigned long long *types) = 0;
+	// Whether an event's device handle belongs to this GPU
+	virtual bool has_handle(nvmlDevice_t handle) = 0;
+	virtual nvmlReturn_t get_gpm_support(unsigned int *supported) = 0;
+	virtual nvmlReturn_t get_gpm_sample(nvmlGpmSample_t sample) = 0;
+	// GPU instances while MIG is enabled, none otherwise
+	virtual nvmlReturn_t get_mig_instances(std::vector<MigInstanceInfo> &instances) = 0;
+	virtual nvmlReturn_t get_gpm_mig_sample(unsigned int gpu_instance_id, nvmlGpmSample_t sample) = 0;
+	// PCI bus IDs at the far end of the active NVLinks, a GPU or an NVSwitch
+	virtual nvmlReturn_t get_nvlink_peers(std::vector<std::string> &bus_ids) = 0;
+};
+
+/* A physical GPU through NVML */
+class NvmlDevice : public GpuDevice {
+public:
+	nvmlReturn_t open(unsigned int index) override {
+		return nvmlDeviceGetHandleByIndex(index, &device);
+	}
+	nvmlReturn_t reopen(const char *uuid) override {
+		// Enumerating first makes the driver pick up GPUs that came back
+		unsigned int count;
+		nvmlReturn_t result = nvmlDeviceGetCount(&count);
+		if(result != NVML_SUCCESS) {
+			return result;
+		}
+		return nvmlDeviceGetHandleByUUID(uuid, &device);
+	}
+	nvmlReturn_t get_uuid(char *uuid, unsigned int length) override {
+		return nvmlDeviceGetUUID(device, uuid, length);
+	}
+	nvmlReturn_t get_name(char *name, unsigned int length) override {
+		return nvmlDeviceGetName(device, name, length);
+	}
+	nvmlReturn_t get_pci_info(nvmlPciInfo_t *pci) override {
+		return nvmlDeviceGetPciInfo(device, pci);
+	}
+	nvmlReturn_t get_supported_memory_clocks(unsigned int *count, unsigned int *clocks) override {
+		return nvmlDeviceGetSupportedMemoryClocks(device, count, clocks);
+	}
+	nvmlReturn_t get_supported_graphics_clocks(unsigned int mem_clock, unsigned int *count, unsigned int *clocks) override {
+		return nvmlDeviceGetSupportedGraphicsClocks(device, mem_clock, count, clocks);
+	}
+	nvmlReturn_t get_clock_info(nvmlClockType_t type, unsigned int *clock) override {
+		return nvmlDeviceGetClockInfo(device, type, clock);
+	}
+	nvmlReturn_t set_memory_locked_clocks(unsigned int min_clock, unsigned int max_clock) override {
+		return nvmlDeviceSetMemoryLockedClocks(device, min_clock, max_clock);
+	}
+	nvmlReturn_t reset_memory_locked_clocks() override {
+		return nvmlDeviceResetMemoryLockedClocks(device);
+	}
+	nvmlReturn_t set_gpu_locked_clocks(unsigned int min_clock, unsigned int max_clock) override {
+		return nvmlDeviceSetGpuLockedClocks(device, min_clock, max_clock);
+	}
+	nvmlReturn_t reset_gpu_locked_clocks() override {
+		return nvmlDeviceResetGpuLockedClocks(device);
+	}
+	nvmlReturn_t get_utilization_rates(nvmlUtilization_t *utilization) override {
+		return nvmlDeviceGetUtilizationRates(device, utilization);
+	}
+	nvmlReturn_t get_encoder_utilization(unsigned int *utilization, unsigned int *period_us) override {
+		return nvmlDeviceGetEncoderUtilization(device, utilization, period_us);
+	}
+	nvmlReturn_t get_decoder_utilization(unsigned int *utilization, unsigned int *period_us) override {
+		return nvmlDeviceGetDecoderUtilization(device, utilization, period_us);
+	}
+	nvmlReturn_t get_samples(nvmlSamplingType_t type, unsigned long long last_seen,
+		nvmlValueType_t *value_type, unsigned int *count, nvmlSample_t *samples) override {
+		return nvmlDeviceGetSamples(device, type, last_seen, value_type, count, samples);
+	}
+	nvmlReturn_t get_compute_running_processes(unsigned int *count, nvmlProcessInfo_t *processes) override {
+		return nvmlDeviceGetComputeRunningProcesses(device, count, processes);
+	}
+	nvmlReturn_t get_power_usage(unsigned int *power_mw) override {
+		return nvmlDeviceGetPowerUsage(device, power_mw);
+	}
+	nvmlReturn_t get_field_values(int count, nvmlFieldValue_t *values) override {
+		return nvmlDeviceGetFieldValues(device, count, values);
+	}
+	nvmlReturn_t get_enforced_power_limit(unsigned int *limit_mw) override {
+		return nvmlDeviceGetEnforcedPowerLimit(device, limit_mw);
+	}
+	nvmlReturn_t get_temperature(unsigned int *temperature) override {
+		return nvmlDeviceGetTemperature(device, NVML_TEMPERATURE_GPU, temperature);
+	}
+	nvmlReturn_t get_slowdown_temperature(unsigned int *temperature) override {
+		return nvmlDeviceGetTemperatureThreshold(device, NVML_TEMPERATURE_THRESHOLD_SLOWDOWN, temperature);
+	}
+	nvmlReturn_t register_events(nvmlEventSet_t set, unsigned long long *types) override {
+		unsigned long long supported_types;
+		nvmlReturn_t result = nvmlDeviceGetSupportedEventTypes(device, &supported_types);
+		if(result != NVML_SUCCESS) {
+			return result;
+		}
+		*types &= supported_types;
+		if(*types == 0) {
+			return NVML_ERROR_NOT_SUPPORTED;
+		}
+		return nvmlDeviceRegisterEvents(device, *types, set);
+	}
+	bool has_handle(nvmlDevice_t handle) override {
+		return handle == device;
+	}
+	nvmlReturn_t get_gpm_support(unsigned int *supported) override {
+		nvmlGpmSupport_t support = {};
+		support.version = NVML_GPM_SUPPORT_VERSION;
+		nvmlReturn_t result = nvmlGpmQueryDeviceSupport(device, &support);
+		*supported = support.isSupportedDevice;
+		return result;
+	}
+	nvmlReturn_t get_gpm_sample(nvmlGpmSample_t sample) override {
+		return nvmlGpmSampleGet(device, sample);
+	}
+	nvmlReturn_t get_mig_instances(std::vector<MigInstanceInfo> &instances) override {
+		unsigned int current_mode, pending_mode;
+		nvmlReturn_t result = nvmlDeviceGetMigMode(device, &current_mode, &pending_mode);
+		instances.clear();
+		if(result != NVML_SUCCESS || current_mode != NVML_DEVICE_MIG_ENABLE) {
+			return result;
+		}
+
+		unsigned int count;
+		result = nvmlDeviceGetMaxMigDeviceCount(device, &count);
+		if(result != NVML_SUCCESS) {
+			return result;
+		}
+		// One MIG device per compute instance, summed up per GPU instance
+		for(unsigned int i = 0; i < count; i++) {
+			nvmlDevice_t mig_device;
+			result = nvmlDeviceGetMigDeviceHandleByIndex(device, i, &mig_device);
+			if(result == NVML_ERROR_NOT_FOUND) {
+				continue;
+			}
+			unsigned int gpu_instance_id;
+			nvmlDeviceAttributes_t attributes;
+			if(result == NVML_SUCCESS) {
+				result = nvmlDeviceGetGpuInstanceId(mig_device, &gpu_instance_id);
+			}
+			if(result == NVML_SUCCESS) {
+				result = nvmlDeviceGetAttributes(mig_device, &attributes);
+			}
+			if(result != NVML_SUCCESS) {
+				return result;
+			}
+			auto found = std::find_if(instances.begin(), instances.end(),
+				[&](const MigInstanceInfo &instance) { return instance.gpu_instance_id == gpu_instance_id; });
+			if(found == instances.end()) {
+				instances.push_back({gpu_instance_id, attributes.multiprocessorCount});
+			} else {
+				found->sm_count += attributes.multiprocessorCount;
+			}
+		}
+		return NVML_SUCCESS;
+	}
+	nvmlReturn_t get_gpm_mig_sample(unsigned int gpu_instance_id, nvmlGpmSample_t sample) override {
+		return nvmlGpmMigSampleGet(device, gpu_instance_id, sample);
+	}
+	nvmlReturn_t get_nvlink_peers(std::vector<std::string> &bus_ids) override {
+		bus_ids.clear();
+		for(unsigned int link = 0; link < NVML_NVLINK_MAX_LINKS; link++) {
+			nvmlEnableState_t active;
+			nvmlReturn_t result = nvmlDeviceGetNvLinkState(device, link, &active);
+			if(result == NVML_ERROR_INVALID_ARGUMENT || (result == NVML_ERROR_NOT_SUPPORTED && link == 0)) {
+				// Past the last link, or no NVLink at all
+				return link == 0 ? result : NVML_SUCCESS;
+			}
+			if(result != NVML_SUCCESS || active != NVML_FEATURE_ENABLED) {
+				continue;
+			}
+			nvmlPciInfo_t remote;
+			result = nvmlDeviceGetNvLinkRemotePciInfo(device, link, &remote);
+			if(result != NVML_SUCCESS) {
+				return result;
+			}
+			if(std::find(bus_ids.begin(), bus_ids.end(), remote.busId) == bus_ids.end()) {
+				bus_ids.push_back(remote.busId);
+			}
+		}
+		return NVML_SUCCESS;
+	}
+
+private:
+	nvmlDevice_t device;
+};
+
+/* A physical GPU whose clocks are only pretended to be set. Readings come
+ * from the GPU, read-backs of the memory clock return the simulated one. */
+class DryRunDevice : public NvmlDevice {
+public:
+	nvmlReturn_t get_clock_info(nvmlClockType_t type, unsigned int *clock) override {
+		if(type == NVML_CLOCK_MEM && simulated_clock != 0) {
+			*clock = simulated_clock;
+			return NVML_SUCCESS;
+		}
+		return NvmlDevice::get_clock_info(type, clock);
+	}
+	nvmlReturn_t set_memory_locked_clocks(unsigned int min_clock, unsigned int) override {
+		simulated_clock = min_clock;
+		return NVML_SUCCESS;
+	}
+	nvmlReturn_t reset_memory_locked_clocks() override {
+		simulated_clock = 0;
+		return NVML_SUCCESS;
+	}
+	nvmlReturn_t set_gpu_locked_clocks(unsigned int, unsigned int) override {
+		return NVML_SUCCESS;
+	}
+	nvmlReturn_t reset_gpu_locked_clocks() override {
+		return NVML_SUCCESS;
+	}
+
+private:
+	// 0 while the driver picks the clock
+	unsigned int simulated_clock = 0;
+};
+
+/* One utilization sample of a recorded trace */
+struct TraceSample {
+	long long time_us;
+	unsigned int gpu;
+	unsigned int memory;
+	unsigned int encoder;
+	unsigned int decoder;
+};
+
+/* Simulated GPU playing back a trace on a virtual clock, the caller
+ * advances the clock. Tracks how well the applied clocks fit the load. */
+class ReplayDevice : public GpuDevice {
+public:
+	// Samples must be sorted by time, starting at 0
+	ReplayDevice(std::vector<TraceSample> samples, std::vector<unsigned int> mem_clocks, const PowermizerConfig &cfg) :
+		trace(std::move(samples)), supported_clocks(std::move(mem_clocks)), config(cfg) {
+		std::sort(supported_clocks.rbegin(), supported_clocks.rend());
+		max_clock = supported_clocks[0];
+		applied_clock = max_clock;
+	}
+
+	std::chrono::steady_clock::time_point now() override {
+		return origin + std::chrono::microseconds(current_us);
+	}
+
+	long long duration_us() {
+		return trace.back().time_us;
+	}
+
+	// Move the virtual clock forward, charging each trace sample to the clock applied meanwhile
+	void advance_to(std::chrono::steady_clock::time_point t) {
+		long long target = std::min((long long)std::chrono::duration_cast<std::chrono::microseconds>(t - origin).count(), duration_us());
+		while(current_us < target) {
+			while(cursor + 1 < trace.size() && trace[cursor + 1].time_us <= current_us) {
+				cursor++;
+			}
+			long long segment_end = cursor + 1 < trace.size() ? std::min(target, trace[cursor + 1].time_us) : target;
+			account(trace[cursor], segment_end - current_us);
+			current_us = segment_end;
+		}
+	}
+
+	double get_energy_j() {
+		return energy_j;
+	}
+
+	long long get_underclocked_busy_us() {
+		return underclocked_busy_us;
+	}
+
+	nvmlReturn_t open(unsigned int) override {
+		return NVML_SUCCESS;
+	}
+	nvmlReturn_t reopen(const char *) override {
+		return NVML_SUCCESS;
+	}
+	nvmlReturn_t get_uuid(char *uuid, unsigned int length) override {
+		snprintf(uuid, length, "replay");
+		return NVML_SUCCESS;
+	}
+	nvmlReturn_t get_name(char *name, unsigned int length) override {
+		snprintf(name, length, "Replay");
+		return NVML_SUCCESS;
+	}
+	nvmlReturn_t get_pci_info(nvmlPciInfo_t *pci) override {
+		*pci = {};
+		snprintf(pci->busIdLegacy, sizeof(pci->busIdLegacy), "trace");
+		return NVML_SUCCESS;
+	}
+	nvmlReturn_t get_supported_memory_clocks(unsigned int *count, unsigned int *clocks) override {
+		return copy_clocks(supported_clocks, count, clocks);
+	}
+	nvmlReturn_t get_supported_graphics_clocks(unsigned int, unsigned int *count, unsigned int *clocks) override {
+		return copy_clocks(graphics_clocks, count, clocks);
+	}
+	nvmlReturn_t get_clock_info(nvmlClockType_t type, unsigned int *clock) override {
+		*clock = type == NVML_CLOCK_MEM ? applied_clock : graphics_clocks[0];
+		return NVML_SUCCESS;
+	}
+	nvmlReturn_t set_memory_locked_clocks(unsigned int min_clock, unsigned int) override {
+		applied_clock = min_clock;
+		return NVML_SUCCESS;
+	}
+	nvmlReturn_t reset_memory_locked_clocks() override {
+		applied_clock = max_clock;
+		return NVML_SUCCESS;
+	}
+	nvmlReturn_t set_gpu_locked_clocks(unsigned int, unsigned int) override {
+		return NVML_SUCCESS;
+	}
+	nvmlReturn_t reset_gpu_locked_clocks() override {
+		return NVML_SUCCESS;
+	}
+	nvmlReturn_t get_utilization_rates(nvmlUtilization_t *utilization) override {
+		utilization->gpu = current().gpu;
+		utilization->memory = current().memory;
+		return NVML_SUCCESS;
+	}
+	nvmlReturn_t get_encoder_utilization(unsigned int *utilization, unsigned int *period_us) override {
+		*utilization = current().encoder;
+		*period_us = sample_period_us;
+		return NVML_SUCCESS;
+	}
+	nvmlReturn_t get_decoder_utilization(unsigned int *utilization, unsigned int *period_us) override {
+		*utilization = current().decoder;
+		*period_us = sample_period_us;
+		return NVML_SUCCESS;
+	}
+	// Samples up to the virtual now, newest last, timestamps offset by one so 0 means none seen
+	nvmlReturn_t get_samples(nvmlSamplingType_t type, unsigned long long last_seen,
+		nvmlValueType_t *value_type, unsigned int *count, nvmlSample_t *samples) override {
+		if(!samples) {
+			*count = sample_buffer_size;
+			return NVML_SUCCESS;
+		}
+		size_t first = 0;
+		while(first <= cursor && (unsigned long long)trace[first].time_us + 1 <= last_seen) {
+			first++;
+		}
+		size_t available = cursor + 1 - first;
+		if(available == 0) {
+			return NVML_ERROR_NOT_FOUND;
+		}
+		*count = std::min((size_t)*count, available);
+		*value_type = NVML_VALUE_TYPE_UNSIGNED_INT;
+		for(unsigned int i = 0; i < *count; i++) {
+			const TraceSample &sample = trace[cursor + 1 - *count + i];
+			samples[i].timeStamp = sample.time_us + 1;
+			switch(type) {
+			case NVML_MEMORY_UTILIZATION_SAMPLES:
+				samples[i].sampleValue.uiVal = sample.memory;
+				break;
+			case NVML_ENC_UTILIZATION_SAMPLES:
+				samples[i].sampleValue.uiVal = sample.encoder;
+				break;
+			case NVML_DEC_UTILIZATION_SAMPLES:
+				samples[i].sampleValue.uiVal = sample.decoder;
+				break;
+			default:
+				samples[i].sampleValue.uiVal = sample.gpu;
+				break;
+			}
+		}
+		return NVML_SUCCESS;
+	}
+	nvmlReturn_t get_compute_running_processes(unsigned int *count, nvmlProcessInfo_t *) override {
+		*count = 0;
+		return NVML_SUCCESS;
+	}
+	nvmlReturn_t get_power_usage(unsigned int *power_mw) override {
+		*power_mw = 1000.0 * (30.0 + 60.0 * applied_clock / max_clock);
+		return NVML_SUCCESS;
+	}
+	nvmlReturn_t get_field_values(int, nvmlFieldValue_t *) override {
+		return NVML_ERROR_NOT_SUPPORTED;
+	}
+	nvmlReturn_t get_enforced_power_limit(unsigned int *) override {
+		return NVML_ERROR_NOT_SUPPORTED;
+	}
+	nvmlReturn_t get_temperature(unsigned int *) override {
+		return NVML_ERROR_NOT_SUPPORTED;
+	}
+	nvmlReturn_t get_slowdown_temperature(unsigned int *) override {
+		return NVML_ERROR_NOT_SUPPORTED;
+	}
+	nvmlReturn_t register_events(nvmlEventSet_t, unsigned long long *) override {
+		return NVML_ERROR_NOT_SUPPORTED;
+	}
+	bool has_handle(nvmlDevice_t) override {
+		return false;
+	}
+	nvmlReturn_t get_gpm_support(unsigned int *supported) override {
+		*supported = 0;
+		return NVML_SUCCESS;
+	}
+	nvmlReturn_t get_gpm_sample(nvmlGpmSample_t) override {
+		return NVML_ERROR_NOT_SUPPORTED;
+	}
+	nvmlReturn_t get_mig_instances(std::vector<MigInstanceInfo> &instances) override {
+		instances.clear();
+		return NVML_ERROR_NOT_SUPPORTED;
+	}
+	nvmlReturn_t get_gpm_mig_sample(unsigned int, nvmlGpmSample_t) override {
+		return NVML_ERROR_NOT_SUPPORTED;
+	}
+	nvmlReturn_t get_nvlink_peers(std::vector<std::string> &bus_ids) override {
+		bus_ids.clear();
+		return NVML_ERROR_NOT_SUPPORTED;
+	}
+
+private:
+	const TraceSample &current() {
+		return trace[cursor];
+	}
+
+	static nvmlReturn_t copy_clocks(const std::vector<unsigned int> &from, unsigned int *count, unsigned int *clocks) {
+		if(!clocks || *count < from.size()) {
+			*count = from.size();
+			return clocks ? NVML_ERROR_INSUFFICIENT_SIZE : NVML_SUCCESS;
+		}
+		*count = from.size();
+		std::copy(from.begin(), from.end(), clocks);
+		return NVML_SUCCESS;
+	}
+
+	// Power is modeled as a fixed part plus a part proportional to the memory clock,
+	// only the difference between runs of the same trace is meaningful
+	void account(const TraceSample &sample, long long span_us) {
+		double power_w = 30.0 + 60.0 * applied_clock / max_clock;
+		energy_j += power_w * span_us / 1e6;
+
+		unsigned int load = sample.gpu;
+		if(config.en_de_coder_enabled) {
+			load = std::max({load, sample.encoder, sample.decoder});
+		}
+		bool busy = load >= config.boost_utilization ||
+			(config.mem_enabled && sample.memory >= config.mem_boost_utilization);
+		if(busy && applied_clock < max_clock) {
+			underclocked_busy_us += span_us;
+		}
+	}
+
+	static constexpr unsigned int sample_buffer_size = 120;
+	static constexpr unsigned int sample_period_us = 166667;
+
+	std::vector<TraceSample> trace;
+	std::vector<unsigned int> supported_clocks;
+	std::vector<unsigned int> graphics_clocks = {1980, 1410, 1005, 600, 210};
+	PowermizerConfig config;
+	unsigned int max_clock;
+	unsigned int applied_clock;
+
+	// Virtual clock, away from the epoch which marks unset times
+	const std::chrono::steady_clock::time_point origin = std::chrono::steady_clock::time_point(std::chrono::seconds(1));
+	long long current_us = 0;
+	size_t cursor = 0;
+
+	double energy_j = 0;
+	long long underclocked_busy_us = 0;
+};
+
+/* GPUs that always run at the same power state, e.g. the ranks of a
+ * tensor-parallel job, where the slowest GPU paces the collective. The
+ * first member still answering in time decides on the busiest member's readings
+ * and the tightest governor cap, the others follow at their next sample. */
+class GpuGroup {
+public:
+	explicit GpuGroup(const std::string &group_name) : name(group_name) {}
+
+	// Members join before sampling starts, returns the member's slot
+	unsigned int add(std::shared_ptr<InstanceMetrics> metrics) {
+		members.push_back(std::make_unique<Member>(metrics));
+		return members.size() - 1;
+	}
+
+	size_t size() const {
+		return members.size();
+	}
+
+	bool leads(unsigned int slot) const {
+		for(unsigned int i = 0; i < slot; i++) {
+			if(members[i]->active()) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// Tightest cap of the members, numerically the highest state
+	int publish_cap(unsigned int slot, int cap) {
+		members[slot]->cap.store(cap, std::memory_order_relaxed);
+		int group_cap = 0;
+		for(auto &member : members) {
+			if(member->active()) {
+				group_cap = std::max(group_cap, member->cap.load(std::memory_order_relaxed));
+			}
+		}
+		return group_cap;
+	}
+
+	void publish(unsigned int slot, const UtilizationInputs &inputs) {
+		Member &member = *members[slot];
+		member.boost.store(inputs.boost, std::memory_order_relaxed);
+		member.low_power.store(inputs.low_power, std::memory_order_relaxed);
+		member.mem_boost.store(inputs.mem_boost, std::memory_order_relaxed);
+		member.mem_low_power.store(inputs.mem_low_power, std::memory_order_relaxed);
+	}
+
+	// Raise the inputs to the busiest member's, lost or degraded members do not count
+	void combine(UtilizationInputs *inputs) const {
+		for(auto &member : members) {
+			if(!member->active()) {
+				continue;
+			}
+			inputs->boost = std::max(inputs->boost, member->boost.load(std::memory_order_relaxed));
+			inputs->low_power = std::max(inputs->low_power, member->low_power.load(std::memory_order_relaxed));
+			inputs->mem_boost = std::max(inputs->mem_boost, member->mem_boost.load(std::memory_order_relaxed));
+			inputs->mem_low_power = std::max(inputs->mem_low_power, member->mem_low_power.load(std::memory_order_relaxed));
+		}
+	}
+
+	int get_state() const {
+		return state.load(std::memory_order_relaxed);
+	}
+
+	void set_state(int new_state) {
+		state.store(new_state, std::memory_order_relaxed);
+	}
+
+	const std::string name;
+
+private:
+	struct Member {
+		explicit Member(std::shared_ptr<InstanceMetrics> source) : metrics(source) {}
+		// Lost and stalled members neither lead nor contribute readings
+		bool active() const {
+			return !metrics->lost.load(std::memory_order_relaxed) && !metrics->degraded.load(std::memory_order_relaxed);
+		}
+		std::shared_ptr<InstanceMetrics> metrics;
+		std::atomic<unsigned int> boost{0};
+		std::atomic<unsigned int> low_power{0};
+		std::atomic<unsigned int> mem_boost{0};
+		std::atomic<unsigned int> mem_low_power{0};
+		std::atomic<int> cap{0};
+	};
+
+	std::vector<std::unique_ptr<Member>> members;
+	std::atomic<int> state{0};
+};
+
+/* Powermizer instance for a GPU */
+class PowermizerInstance {
+public:
+	PowermizerInstance(std::unique_ptr<GpuDevice> gpu, int device_index, const PowermizerConfig &cfg,
+		const ProfileSet *profiles = nullptr, const HandoffState *handoff = nullptr) :
+		device(std::move(gpu)), index(device_index), config(cfg) {
+
+		nvmlReturn_t result;
+		// Get device handle
+		result = device->open(index);
+		if(result != NVML_SUCCESS) {
+			log_printf(LOG_ERROR, "GPU%d: Failed to get device handle: %s", index, nvmlErrorString(result));
+			supported = false;
+			return;
+		}
+
+		supported = initialize(profiles, handoff);
+		// Runtime updates start from the settings in effect
+		shadow_config = config;
+	};
+
+	~PowermizerInstance() {
+		if(workload_pid != 0 && !is_lost()) {
+			finish_workload(device->now());
+		}
+		reset_clocks();
+		delete pending_config.exchange(nullptr);
+	};
+
+	// Hand clock control back to the driver, done once
+	void reset_clocks() {
+		// A lost GPU has no clocks to hand back, the driver resets them with it
+		if(supported && !clocks_reset && !metrics->lost.load(std::memory_order_relaxed)) {
+			nvmlReturn_t result;
+
+			// Reset control
+			log_printf(LOG_DEBUG, "GPU%d: Resetting memory clocks", index);
+			result = device->reset_memory_locked_clocks();
+			if(result != NVML_SUCCESS) {
+				log_printf(LOG_ERROR, "GPU%d: Failed to reset memory clocks: %s", index, nvmlErrorString(result));
+			}
+			if(config.gpu_clocks_enabled) {
+				log_printf(LOG_DEBUG, "GPU%d: Resetting graphics clocks", index);
+				result = device->reset_gpu_locked_clocks();
+				if(result != NVML_SUCCESS) {
+					log_printf(LOG_ERROR, "GPU%d: Failed to reset graphics clocks: %s", index, nvmlErrorString(result));
+				}
+			}
+			clocks_reset = true;
+		}
+	}
+
+	// Leave the clocks locked for the next run instead of resetting them,
+	// false if there is nothing to hand over
+	bool hand_off(HandoffEntry *entry) {
+		if(!supported || clocks_reset || metrics->lost.load(std::memory_order_relaxed)) {
+			return false;
+		}
+		auto age = std::chrono::duration_cast<std::chrono::milliseconds>(device->now() - last_update);
+		entry->mem_clock = applied_clock;
+		entry->last_update_ms = wall_clock_ms() - age.count();
+		clocks_reset = true;
+		log_printf(LOG_INFO, "GPU%d: Leaving memory clock locked at %d MHz for the next run", index, applied_clock);
+		return true;
+	}
+
+	const std::string &get_uuid() {
+		return uuid;
+	}
+
+	bool is_supported() {
+		return supported;
+	}
+
+	bool is_lost() {
+		return metrics->lost.load(std::memory_order_relaxed);
+	}
+
+	int get_index() {
+		return index;
+	}
+
+	std::shared_ptr<InstanceMetrics> get_metrics() {
+		return metrics;
+	}
+
+	int get_max_power_state() {
+		return max_power_state;
+	}
+
+	int get_clock(int state) {
+		return clocks[state];
+	}
+
+	// Reapply profiles on top of the command line settings. Settings only read
+	// at start-up keep their values, with a warning when they differ.
+	void reload_profiles(const PowermizerConfig &base, const ProfileSet &profiles) {
+		PowermizerConfig resolved = base;
+		profiles.resolve(resolved, index, name.c_str(), bus_id.c_str(), bus_id_legacy.c_str());
+		if(resolved.boost_utilization == SETTING_UNSET || resolved.low_power_utilization == SETTING_UNSET ||
+			resolved.boost_activate_time == SETTING_UNSET || resolved.low_power_activate_time == SETTING_UNSET) {
+			log_printf(LOG_ERROR, "GPU%d: Thresholds missing after reload, keeping current settings", index);
+			return;
+		}
+		update_config([&](PowermizerConfig &current) {
+			if(resolved.mem_clocks != current.mem_clocks || resolved.gpu_clocks_enabled != current.gpu_clocks_enabled ||
+				resolved.gpu_boost_clock != current.gpu_boost_clock || resolved.gpu_low_power_clock != current.gpu_low_power_clock ||
+				resolved.sample_stat != current.sample_stat || resolved.sample_percentile != current.sample_percentile ||
+				resolved.gpm_enabled != current.gpm_enabled || resolved.group != current.group) {
+				log_printf(LOG_WARN, "GPU%d: Clock set and sampling changes take effect after a restart", index);
+			}
+			copy_runtime_settings(current, resolved);
+			return true;
+		});
+	}
+
+	const std::string &get_bus_id() {
+		return bus_id;
+	}
+
+	// Group named by the profiles, empty if none
+	const std::string &get_group_name() {
+		return config.group;
+	}
+
+	std::shared_ptr<GpuGroup> get_group() {
+		return group;
+	}
+
+	// Move with the group from now on, before the instance runs
+	void join_group(std::shared_ptr<GpuGroup> target) {
+		group = target;
+		group_slot = group->add(metrics);
+	}
+
+	// Device access for node-level readings, NVML calls are thread-safe
+	GpuDevice *get_device() {
+		return device.get();
+	}
+
+	// Keep the power state at or below this one (numerically at or above), 0 lifts the limit
+	void set_state_cap(int state) {
+		state_cap.store(std::min(std::max(state, 0), max_power_state), std::memory_order_relaxed);
+	}
+
+	int get_state_cap() {
+		return state_cap.load(std::memory_order_relaxed);
+	}
+
+	// Change settings from another thread. The new copy is handed over
+	// through an atomic pointer and picked up at the start of the next tick.
+	template <typename F>
+	bool update_config(F change) {
+		std::lock_guard<std::mutex> lock(update_mutex);
+		PowermizerConfig updated;
+		if(!stage_config(change, updated)) {
+			return false;
+		}
+		commit_config(updated);
+		return true;
+	}
+
+	// Two-step update across instances: hold every lock, stage on copies, then
+	// commit all of them once each staged. Callers hold lock_config() throughout.
+	std::unique_lock<std::mutex> lock_config() {
+		return std::unique_lock<std::mutex>(update_mutex);
+	}
+
+	template <typename F>
+	bool stage_config(F change, PowermizerConfig &staged) {
+		staged = shadow_config;
+		return change(staged);
+	}
+
+	void commit_config(const PowermizerConfig &staged) {
+		shadow_config = staged;
+		delete pending_config.exchange(new PowermizerConfig(staged), std::memory_order_acq_rel);
+	}
+
+	// Hold the highest power state until the given time
+	void boost_hint(std::chrono::steady_clock::time_point until) {
+		boost_until_ns.store(monotonic_ns(until), std::memory_order_relaxed);
+	}
+
+	// Hold a power state until unpinned, -1 unpins
+	void pin_power_state(int state) {
+		pinned_state.store(std::min(state, max_power_state), std::memory_order_relaxed);
+	}
+
+	// Watchdog check from another thread, flags a stalled process() call
+	void check_watchdog(std::chrono::steady_clock::time_point now, unsigned int timeout_ms) {
+		long long since = busy_since.load(std::memory_order_relaxed);
+		if(since != 0) {
+			long long stalled_ms = (monotonic_ns(now) - since) / 1000000LL;
+			if(stalled_ms >= timeout_ms && !metrics->degraded.exchange(true)) {
+				log_printf(LOG_WARN, "GPU%d: NVML call stalled for %lld ms, marking degraded", index, stalled_ms);
+			}
+		} else if(metrics->degraded.exchange(false)) {
+			log_printf(LOG_INFO, "GPU%d: Responsive again", index);
+		}
+	}
+
+	// Watchdog check after a serial tick of the given length. Takes the GPU out
+	// of the loop for a while after a stall so the others keep their schedule.
+	void check_tick_time(std::chrono::steady_clock::time_point now, long long elapsed_ms, unsigned int timeout_ms) {
+		if(elapsed_ms >= timeout_ms) {
+			if(!metrics->degraded.exchange(true)) {
+				log_printf(LOG_WARN, "GPU%d: NVML calls stalled for %lld ms, marking degraded", index, elapsed_ms);
+			}
+			degraded_until = now + std::chrono::milliseconds(degraded_probe_ms);
+		} else if(metrics->degraded.exchange(false)) {
+			log_printf(LOG_INFO, "GPU%d: Responsive again", index);
+			degraded_until = std::chrono::steady_clock::time_point();
+		}
+	}
+
+	// Earliest moment process() may need to run again
+	std::chrono::steady_clock::time_point next_deadline() {
+		if(metrics->lost.load(std::memory_order_relaxed)) {
+			return retry_at;
+		}
+		return std::max(std::min({next_sample, pending_deadline, event_deadline}), degraded_until);
+	}
+
+	void process() {
+		UtilizationInputs inputs;
+		bool history = config.sample_stat != SAMPLE_STAT_NONE;
+
+		// Get current time
+		auto now = device->now();
+		BusyScope busy(busy_since, now);
+		BenchScope timing(bench.get());
+
+		// A lost GPU is only looked for until it answers again
+		if(metrics->lost.load(std::memory_order_relaxed)) {
+			if(now >= retry_at) {
+				supervise(now);
+			}
+			return;
+		}
+
+		metrics->ticks.fetch_add(1, std::memory_order_relaxed);
+
+		// Events wake the loop between samples, those ticks only check the clock.
+		// A due transition samples too, so that its deadline is cleared
+		bool sampling = now >= std::min(next_sample, pending_deadline);
+		event_deadline = std::chrono::steady_clock::time_point::max();
+		if(sampling) {
+			// Schedule next sample on the fixed grid to avoid drift
+			schedule_next_sample(now);
+			pending_deadline = std::chrono::steady_clock::time_point::max();
+		}
+		account_state_time(now);
+
+		// Pick up settings changed at runtime
+		if(pending_config.load(std::memory_order_relaxed)) {
+			apply_pending_config();
+		}
+
+		// Adopt clock changes made behind our back before deciding
+		sync_applied_clock(now);
+		if(!sampling || metrics->lost.load(std::memory_order_relaxed)) {
+			return;
+		}
+		if(mig_changed) {
+			mig_changed = false;
+			init_mig();
+		}
+
+		// The node governor limits how far this GPU may boost,
+		// a group is held to its most limited member
+		int cap = state_cap.load(std::memory_order_relaxed);
+		bool following = false;
+		if(group) {
+			cap = group->publish_cap(group_slot, cap);
+			following = !group->leads(group_slot);
+		}
+		if(power_state < cap) {
+			log_printf(LOG_DEBUG, "GPU%d: Held to state %d by the governor", index, cap);
+			workload_steered = true;
+			note_crossing(TRANSITION_LOWER, now);
+			if(set_power_state(cap)) {
+				last_update = now;
+				record_transition(TRANSITION_LOWER);
+			}
+			return;
+		}
+
+		// External hints override the policy while active
+		int forced_state = pinned_state.load(std::memory_order_relaxed);
+		if(forced_state < 0 && monotonic_ns(now) < boost_until_ns.load(std::memory_order_relaxed)) {
+			forced_state = 0;
+		}
+		if(forced_state >= 0) {
+			workload_steered = true;
+			forced_state = std::max(forced_state, cap);
+			if(forced_state != power_state) {
+				Transition direction = forced_state < power_state ? TRANSITION_BOOST : TRANSITION_LOWER;
+				note_crossing(direction, now);
+				if(!set_power_state(forced_state)) {
+					return;
+				}
+				record_transition(direction);
+			}
+			// Resume hysteresis from here once the hint ends
+			last_update = now;
+			crossing = TRANSITION_NONE;
+			return;
+		}
+
+		// A new compute context is a strong hint that load follows,
+		// unless the workload has been seen before and starts where it settled
+		// Followers leave both to the member deciding for the group
+		unsigned int new_pid = 0;
+		bool started = !following && (config.predict_grace_time > 0 || workload_cache) && detect_new_processes(&new_pid);
+		if(workload_cache && !following && track_workload(started ? new_pid : 0, now, cap)) {
+			started = false;
+		}
+		if(config.predict_grace_time > 0 && started && power_state > cap) {
+			log_printf(LOG_DEBUG, "GPU%d: New compute process, pre-boosting", index);
+			note_crossing(TRANSITION_BOOST, now);
+			if(set_power_state(cap)) {
+				last_update = now;
+				record_transition(TRANSITION_BOOST);
+				predicted_until = now + std::chrono::milliseconds(config.predict_grace_time);
+			}
+		}
+
+		// Get current GPU usage
+		if(!mig_slices.empty()) {
+			if(!read_mig_utilization(&inputs)) {
+				return;
+			}
+		} else if(device_gpm) {
+			if(!read_gpm_utilization(&inputs)) {
+				return;
+			}
+		} else if(history) {
+			if(!read_utilization_history(&inputs)) {
+				return;
+			}
+		} else {
+			if(!read_utilization(&inputs)) {
+				return;
+			}
+		}
+		max_utilization = inputs.boost;
+		metrics->max_utilization.store(max_utilization, std::memory_order_relaxed);
+		account_underclocked(inputs, now);
+		adapt_sampling(inputs, now);
+		if(workload_pid != 0) {
+			workload_bandwidth = std::max(workload_bandwidth, inputs.mem_boost * applied_clock / 100);
+		}
+		if(power_sampling && now >= next_power_sample) {
+			sample_power();
+			next_power_sample = now + std::chrono::milliseconds(power_period_ms);
+		}
+		if(temperature_sampling && now >= next_temperature_sample) {
+			sample_temperature();
+			next_temperature_sample = now + std::chrono::milliseconds(temperature_period_ms);
+		}
+		if(record_channel) {
+			record_sample(inputs);
+		}
+		if(group) {
+			group->publish(group_slot, inputs);
+			// Taking over the decisions starts from where the group is
+			if(following || !group_leading) {
+				follow_group(now, cap);
+				group_leading = !following;
+				return;
+			}
+			group->combine(&inputs);
+		}
+
+		if(config.control_policy != POLICY_HYSTERESIS) {
+			control(inputs, now, cap);
+			return;
+		}
+
+		// Check if we need to change power state
+		// Boost condition
+		// Saturated memory bandwidth alone is enough to boost
+		if(power_state > cap) {
+			if(inputs.boost >= config.boost_utilization ||
+				(config.mem_enabled && inputs.mem_boost >= config.mem_boost_utilization)) {
+				note_crossing(TRANSITION_BOOST, now);
+				// Check if time exceeded
+				auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(now - last_update);
+				if(duration.count() >= config.boost_activate_time) {
+					if(!set_power_state(std::max(boost_target(inputs), cap))) {
+						return;
+					}
+					// Update update time
+					last_update = now;
+					record_transition(TRANSITION_BOOST);
+				} else {
+					pending_deadline = last_update + std::chrono::milliseconds(config.boost_activate_time);
+				}
+				// Action has pended or taken, stop processing
+				return;
+			}
+		}
+
+		// Low power condition
+		// Always one state at a time to keep lowering gradual
+		// Memory bandwidth must be idle as well
+		// Held off while a predictive boost waits for load to arrive
+		if(power_state < max_power_state && now >= predicted_until) {
+			if(inputs.low_power <= config.low_power_utilization &&
+				(!config.mem_enabled || inputs.mem_low_power <= config.mem_low_power_utilization)) {
+				note_crossing(TRANSITION_LOWER, now);
+				// Check if time exceeded
+				auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(now - last_update);
+				if(duration.count() >= lower_residency()) {
+					if(!set_power_state(power_state + 1)) {
+						return;
+					}
+					// Update update time
+					last_update = now;
+					record_transition(TRANSITION_LOWER);
+				} else {
+					pending_deadline = last_update + std::chrono::milliseconds(lower_residency());
+				}
+				// Action has pended or taken, stop processing
+				return;
+			}
+		}
+
+		// No action has taken
+		crossing = TRANSITION_NONE;
+		// History windows already require the condition to be sustained,
+		// so only transitions restart the timer there
+		if(!history) {
+			// Update last update time
+			last_update = now;
+		}
+	}
+
+	// Queue a record per sample to the channel, drained by a TraceRecorder
+	void set_record_channel(TraceChannel *channel) {
+		record_channel = channel;
+	}
+
+	// Step down the ladder and back up, timing every set call and how long the
+	// new clock takes to be reported. Ends at the highest clock.
+	bool calibrate(CalibrationTable &table) {
+		static constexpr int repeats = 3;
+		log_printf(LOG_INFO, "GPU%d: Calibrating %d memory clock transitions", index, 2 * max_power_state);
+		for(int run = 0; run < repeats; run++) {
+			for(int state = 0; state < max_power_state; state++) {
+				if(!measure_transition(state + 1, table)) {
+					return false;
+				}
+			}
+			for(int state = max_power_state; state > 0; state--) {
+				if(!measure_transition(state - 1, table)) {
+					return false;
+				}
+			}
+		}
+		return true;
+	}
+
+	// Hold each state long enough before lowering that the stalls of going down and
+	// back up take at most calibration_stall_share of the time. The lowering time stays the floor,
+	// calibration_residency_factor times it the ceiling.
+	void apply_calibration(const CalibrationTable &table) {
+		calibrated_residency_ms.assign(clocks.size(), 0);
+		for(int state = 0; state < max_power_state; state++) {
+			CalibrationEntry down, up;
+			if(!table.lookup(name, clocks[state], clocks[state + 1], &down) ||
+				!table.lookup(name, clocks[state + 1], clocks[state], &up)) {
+				log_printf(LOG_WARN, "GPU%d: No calibration for %d <-> %d MHz on %s", index, clocks[state], clocks[state + 1], name.c_str());
+				continue;
+			}
+			calibrated_residency_ms[state] = (down.settle_us + up.settle_us) / calibration_stall_share / 1000;
+			calibrated_settle_us[{clocks[state], clocks[state + 1]}] = down.settle_us;
+			calibrated_settle_us[{clocks[state + 1], clocks[state]}] = up.settle_us;
+			unsigned int ceiling_ms = config.low_power_activate_time * calibration_residency_factor;
+			if(calibrated_residency_ms[state] > ceiling_ms) {
+				log_printf(LOG_WARN, "GPU%d: State %d: transitions take %llu / %llu us, holding it %u ms before lowering capped at %u ms",
+					index, state, down.settle_us, up.settle_us, calibrated_residency_ms[state], ceiling_ms);
+			} else {
+				log_printf(LOG_DEBUG, "GPU%d: State %d: transitions take %llu / %llu us, held at least %u ms before lowering",
+					index, state, down.settle_us, up.settle_us, calibrated_residency_ms[state]);
+			}
+		}
+	}
+
+	// Start recurring workloads where they settled before, before the instance runs
+	void set_workload_cache(WorkloadCache *cache) {
+		workload_cache = cache;
+	}
+
+	// Keep every NVML call and process() time from now on, dropping earlier ones
+	void start_bench() {
+		bench = std::make_unique<BenchSamples>();
+	}
+
+	BenchSamples *get_bench() {
+		return bench.get();
+	}
+
+	// Read the power draw at most every period_ms, 0 reads it every sample. Before the instance runs
+	void set_power_sampling(bool enabled, unsigned int period_ms) {
+		power_sampling = enabled;
+		power_period_ms = period_ms;
+	}
+
+	// Read the temperature every period_ms for the governor, before the instance runs
+	void set_temperature_sampling(unsigned int period_ms) {
+		temperature_sampling = true;
+		temperature_period_ms = period_ms;
+	}
+
+	void set_sampling_period(unsigned int period_ms) {
+		sampling_period_ms = period_ms;
+		current_period_ms = period_ms;
+		min_period_ms = max_period_ms = period_ms;
+		metrics->sampling_period_ms.store(period_ms, std::memory_order_relaxed);
+		next_sample = device->now();
+	}
+
+	// Let the interval move between these bounds, after set_sampling_period
+	void set_sampling_range(unsigned int min_ms, unsigned int max_ms) {
+		min_period_ms = min_ms;
+		max_period_ms = max_ms;
+	}
+
+	// Register for clock, Xid and power source events, again after a reattach.
+	// With clock events the memory clock is only read back once it changed.
+	bool watch_events(nvmlEventSet_t set) {
+		event_set = set;
+		unsigned long long types = nvmlEventTypeClock | nvmlEventTypeXidCriticalError | nvmlEventTypePowerSourceChange |
+			nvmlEventMigConfigChange;
+		nvmlReturn_t result = device->register_events(set, &types);
+		if(result != NVML_SUCCESS) {
+			log_printf(LOG_WARN, "GPU%d: Events not available, polling only: %s", index, nvmlErrorString(result));
+			clock_events = false;
+			return false;
+		}
+		clock_events = (types & nvmlEventTypeClock) != 0;
+		log_printf(LOG_DEBUG, "GPU%d: Events: clock %s, Xid %s, power source %s", index,
+			clock_events ? "yes" : "no", (types & nvmlEventTypeXidCriticalError) ? "yes" : "no",
+			(types & nvmlEventTypePowerSourceChange) ? "yes" : "no");
+		return true;
+	}
+
+	// Act on an event at once instead of at the next sample
+	void handle_event(const nvmlEventData_t &event) {
+		if(event.eventType & nvmlEventTypeClock) {
+			clock_changed = true;
+		}
+		if(event.eventType & nvmlEventTypeXidCriticalError) {
+			log_printf(LOG_WARN, "GPU%d: Xid %llu reported", index, event.eventData);
+		}
+		if(event.eventType & nvmlEventTypePowerSourceChange) {
+			log_printf(LOG_INFO, "GPU%d: Power source changed", index);
+		}
+		if(event.eventType & nvmlEventMigConfigChange) {
+			mig_changed = true;
+		}
+		event_deadline = device->now();
+	}
+
+private:
+	// Marks the instance busy for the watchdog while in scope
+	struct BusyScope {
+		std::atomic<long long> &since;
+		BusyScope(std::atomic<long long> &since_ref, std::chrono::steady_clock::time_point now) : since(since_ref) {
+			since.store(monotonic_ns(now), std::memory_order_relaxed);
+		}
+		~BusyScope() {
+			since.store(0, std::memory_order_relaxed);
+		}
+	};
+
+	// Records the time spent in process() while benchmarking
+	struct BenchScope {
+		BenchSamples *samples;
+		std::chrono::steady_clock::time_point start;
+		explicit BenchScope(BenchSamples *target) : samples(target) {
+			if(samples) {
+				start = std::chrono::steady_clock::now();
+			}
+		}
+		~BenchScope() {
+			if(samples) {
+				samples->process_us.push_back(std::chrono::duration_cast<std::chrono::microseconds>(
+					std::chrono::steady_clock::now() - start).count());
+			}
+		}
+	};
+
+	// Set up the device behind the handle, again after each reattach
+	bool initialize(const ProfileSet *profiles, const HandoffState *handoff) {
+		nvmlReturn_t result;
+
+		// Get device name
+		char device_name[NVML_DEVICE_NAME_BUFFER_SIZE];
+		result = device->get_name(device_name, NVML_DEVICE_NAME_BUFFER_SIZE);
+		if(result != NVML_SUCCESS) {
+			log_printf(LOG_ERROR, "GPU%d: Failed to get device name: %s", index, nvmlErrorString(result));
+			return false;
+		}
+
+		// Get PCI info
+		nvmlPciInfo_t pci_info;
+		result = device->get_pci_info(&pci_info);
+		if(result != NVML_SUCCESS) {
+			log_printf(LOG_ERROR, "GPU%d: Failed to get PCI info: %s", index, nvmlErrorString(result));
+			return false;
+		}
+
+		// The UUID survives resets and re-enumeration, the index may not
+		char device_uuid[NVML_DEVICE_UUID_BUFFER_SIZE];
+		result = device->get_uuid(device_uuid, NVML_DEVICE_UUID_BUFFER_SIZE);
+		if(result != NVML_SUCCESS) {
+			log_printf(LOG_ERROR, "GPU%d: Failed to get UUID: %s", index, nvmlErrorString(result));
+			return false;
+		}
+
+		log_printf(LOG_INFO, "GPU%d: %s (%s) initializing", index, device_name, pci_info.busIdLegacy);
+		name = device_name;
+		uuid = device_uuid;
+		bus_id = pci_info.busId;
+		bus_id_legacy = pci_info.busIdLegacy;
+
+		// Settings of this GPU's profiles take precedence over the command line
+		if(profiles) {
+			profiles->resolve(config, index, device_name, pci_info.busId, pci_info.busIdLegacy);
+		}
+		if(config.boost_utilization == SETTING_UNSET || config.low_power_utilization == SETTING_UNSET ||
+			config.boost_activate_time == SETTING_UNSET || config.low_power_activate_time == SETTING_UNSET) {
+			log_printf(LOG_ERROR, "GPU%d: Boost and low power thresholds and times must all be set", index);
+			return false;
+		}
+
+		// Get the max and min memory clocks
+		std::vector<unsigned int> mem_clocks;
+		if(!get_supported_mem_clocks(mem_clocks)) {
+			return false;
+		}
+
+		log_printf(LOG_DEBUG, "GPU%d: Supported memory clocks:", index);
+		for(unsigned int i = 0; i < mem_clocks.size(); i++) {
+			log_printf(LOG_DEBUG, "GPU%d: %d MHz", index, mem_clocks[i]);
+		}
+
+		// Push elements to vector, keeping only the selected clocks if any
+		std::vector<int> ladder;
+		for(unsigned int clock : mem_clocks) {
+			if(config.mem_clocks.empty() ||
+				std::find(config.mem_clocks.begin(), config.mem_clocks.end(), clock) != config.mem_clocks.end()) {
+				ladder.push_back(clock);
+			}
+		}
+		for(unsigned int clock : config.mem_clocks) {
+			if(std::find(mem_clocks.begin(), mem_clocks.end(), clock) == mem_clocks.end()) {
+				log_printf(LOG_WARN, "GPU%d: Memory clock %d MHz not supported, ignored", index, clock);
+			}
+		}
+		if(ladder.empty()) {
+			log_printf(LOG_ERROR, "GPU%d: None of the selected memory clocks is supported", index);
+			return false;
+		}
+		// Other threads hold on to the states, a reattached GPU must offer the same ones
+		if(metrics) {
+			if(ladder != clocks) {
+				log_printf(LOG_ERROR, "GPU%d: Supported memory clocks changed, restart to pick them up", index);
+				return false;
+			}
+		} else {
+			clocks = ladder;
+			max_power_state = clocks.size() - 1;
+			metrics = std::make_shared<InstanceMetrics>(index, clocks.size());
+			workload_state_us.reset(new unsigned long long[clocks.size()]());
+		}
+
+		log_printf(LOG_DEBUG, "GPU%d: Registered power states: %d", index, (int)clocks.size());
+
+		// Pair each memory clock with a graphics clock range
+		if(config.gpu_clocks_enabled && !build_gpu_clock_ranges()) {
+			log_printf(LOG_WARN, "GPU%d: Graphics clock locking disabled", index);
+			config.gpu_clocks_enabled = false;
+		}
+
+		// Take over the lock a previous run handed off while it is still in
+		// place, otherwise set to max power state unless it is already applied
+		unsigned int current_clock = 0;
+		bool clock_read = read_memory_clock(&current_clock);
+		HandoffEntry handed = {};
+		long long handoff_age_ms = -1;
+		auto adopted = std::find(clocks.begin(), clocks.end(), (int)current_clock);
+		if(handoff && handoff->find(uuid, &handed) && clock_read && handed.mem_clock == current_clock && adopted != clocks.end()) {
+			power_state = adopted - clocks.begin();
+			handoff_age_ms = std::max(wall_clock_ms() - handed.last_update_ms, 0LL);
+			log_printf(LOG_INFO, "GPU%d: Adopted memory clock %d MHz from the previous run", index, current_clock);
+		} else if(clock_read && current_clock == (unsigned int)clocks[0]) {
+			log_printf(LOG_DEBUG, "GPU%d: Memory clock already at %d MHz", index, clocks[0]);
+		} else {
+			result = device->set_memory_locked_clocks(clocks[0], clocks[0]);
+			if(result != NVML_SUCCESS) {
+				log_printf(LOG_ERROR, "GPU%d: Failed to manipulate clocks: %s", index, nvmlErrorString(result));
+				return false;
+			}
+			start_settling(clock_read ? (int)current_clock : 0, clocks[0]);
+		}
+		applied_clock = clocks[power_state];
+		metrics->memory_clock = applied_clock;
+		metrics->power_state = power_state;
+
+		if(config.gpu_clocks_enabled && !set_gpu_clock_range(power_state)) {
+			return false;
+		}
+
+		// Size the NVML sample buffer once so the loop never allocates
+		if(config.sample_stat != SAMPLE_STAT_NONE) {
+			nvmlValueType_t sample_type;
+			result = device->get_samples(NVML_GPU_UTILIZATION_SAMPLES, 0, &sample_type, &sample_buffer_size, NULL);
+			if(result == NVML_SUCCESS && sample_buffer_size > 0) {
+				sample_buffer = std::make_unique<nvmlSample_t[]>(sample_buffer_size);
+				log_printf(LOG_DEBUG, "GPU%d: Utilization sample buffer: %d entries", index, sample_buffer_size);
+			} else {
+				log_printf(LOG_WARN, "GPU%d: Utilization samples not available, falling back to point sampling: %s", index, nvmlErrorString(result));
+				config.sample_stat = SAMPLE_STAT_NONE;
+			}
+		}
+
+		// The memory clock is shared by all MIG instances, so is their load
+		init_mig();
+		// Device-wide GPM, MIG instances are sampled on their own
+		device_gpm.reset();
+		if(config.gpm_enabled && mig_slices.empty() && !init_gpm()) {
+			log_printf(LOG_WARN, "GPU%d: GPM not available, deciding on utilization counters", index);
+			config.gpm_enabled = false;
+		}
+
+		// Power and energy in one call if the driver has them as fields
+		nvmlFieldValue_t fields[power_field_count];
+		field_batch = read_power_fields(fields) == NVML_SUCCESS;
+		metrics->energy_sampled.store(field_batch && fields[1].nvmlReturn == NVML_SUCCESS, std::memory_order_relaxed);
+		log_printf(LOG_DEBUG, "GPU%d: Power readings: %s", index, field_batch ? "batched field values" : "single calls");
+
+		// Reset last update time, a handed off state keeps its age
+		last_update = device->now() - std::chrono::milliseconds(std::max(handoff_age_ms, 0LL));
+
+		log_printf(LOG_DEBUG, "GPU%d: Boost utilization: %d%%", index, config.boost_utilization);
+		log_printf(LOG_DEBUG, "GPU%d: Low power utilization: %d%%", index, config.low_power_utilization);
+		log_printf(LOG_DEBUG, "GPU%d: Boost time: %d ms", index, config.boost_activate_time);
+		log_printf(LOG_DEBUG, "GPU%d: Low power time: %d ms", index, config.low_power_activate_time);
+		if(config.mem_enabled) {
+			log_printf(LOG_DEBUG, "GPU%d: Memory boost utilization: %d%%", index, config.mem_boost_utilization);
+			log_printf(LOG_DEBUG, "GPU%d: Memory low power utilization: %d%%", index, config.mem_low_power_utilization);
+		}
+		log_printf(LOG_DEBUG, "GPU%d: Boost policy: %s", index, boost_policy_names[config.boost_policy]);
+		log_printf(LOG_DEBUG, "GPU%d: Control policy: %s", index, control_policy_names[config.control_policy]);
+		if(config.predict_grace_time > 0) {
+			log_printf(LOG_DEBUG, "GPU%d: Predictive boost grace time: %d ms", index, config.predict_grace_time);
+		}
+		log_printf(LOG_DEBUG, "GPU%d: Encoder and decoder utilization: %s", index, config.en_de_coder_enabled ? "enabled" : "disabled");
+		if(config.sample_stat == SAMPLE_STAT_MEAN) {
+			log_printf(LOG_DEBUG, "GPU%d: Utilization history: mean", index);
+		} else if(config.sample_stat == SAMPLE_STAT_PERCENTILE) {
+			log_printf(LOG_DEBUG, "GPU%d: Utilization history: p%d", index, config.sample_percentile);
+		}
+
+		log_printf(LOG_INFO, "GPU%d: %s (%s) initialized", index, device_name, pci_info.busIdLegacy);
+		return true;
+	}
+
+
+	// Run an NVML call and record its latency
+	template <typename F>
+	nvmlReturn_t timed(NvmlCall call, F fn) {
+		auto start = std::chrono::steady_clock::now();
+		nvmlReturn_t result = fn();
+		auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+		metrics->nvml_latency[call]->observe(elapsed.count());
+		metrics->nvml_calls.fetch_add(1, std::memory_order_relaxed);
+		if(bench) {
+			bench->call_us[call].push_back(elapsed.count());
+		}
+		if(is_device_lost(result)) {
+			mark_lost(result);
+		}
+		return result;
+	}
+
+	static bool is_device_lost(nvmlReturn_t result) {
+		return result == NVML_ERROR_GPU_IS_LOST || result == NVML_ERROR_RESET_REQUIRED;
+	}
+
+	// Stop polling the GPU and look for it again with a backoff, warned about once
+	void mark_lost(nvmlReturn_t result) {
+		if(metrics->lost.exchange(true, std::memory_order_relaxed)) {
+			return;
+		}
+		log_printf(LOG_WARN, "GPU%d: Lost, watching for it to come back: %s", index, nvmlErrorString(result));
+		retry_backoff_ms = retry_initial_ms;
+		retry_at = device->now() + std::chrono::milliseconds(retry_backoff_ms);
+	}
+
+	// Retry a lost GPU by UUID and rebuild its state once it answers again
+	void supervise(std::chrono::steady_clock::time_point now) {
+		nvmlReturn_t result = device->reopen(uuid.c_str());
+		if(result == NVML_SUCCESS) {
+			log_printf(LOG_INFO, "GPU%d: Found again, reinitializing", index);
+			reset_device_state();
+			if(initialize(nullptr, nullptr)) {
+				if(event_set) {
+					watch_events(event_set);
+				}
+				metrics->lost.store(false, std::memory_order_relaxed);
+				next_sample = now;
+				last_update = now;
+				last_tick = now;
+				log_printf(LOG_INFO, "GPU%d: Reattached", index);
+				return;
+			}
+			result = NVML_ERROR_UNKNOWN;
+		}
+		log_printf(LOG_DEBUG, "GPU%d: Still lost, next try in %u ms: %s", index, retry_backoff_ms, nvmlErrorString(result));
+		retry_at = now + std::chrono::milliseconds(retry_backoff_ms);
+		retry_backoff_ms = std::min(retry_backoff_ms * 2, retry_max_ms);
+	}
+
+	// Forget what was read from the GPU before it went away
+	void reset_device_state() {
+		power_state = 0;
+		metrics->power_state.store(0, std::memory_order_relaxed);
+		gpu_clock_ranges.clear();
+		applied_gpu_clocks = {0, 0};
+		clocks_reset = false;
+		gpu_samples = SampleHistory();
+		encoder_samples = SampleHistory();
+		decoder_samples = SampleHistory();
+		memory_samples = SampleHistory();
+		known_pid_count = 0;
+		processes_seeded = false;
+		// A reset ends whatever ran, too abruptly to learn from
+		workload_pid = 0;
+		group_leading = false;
+		controller_started = false;
+		crossing = TRANSITION_NONE;
+		last_reading = std::chrono::steady_clock::time_point();
+		pending_deadline = std::chrono::steady_clock::time_point::max();
+		event_deadline = std::chrono::steady_clock::time_point::max();
+		clock_changed = false;
+		settle_deadline = std::chrono::steady_clock::time_point();
+	}
+
+	// Charge the time since the previous tick to the current power state
+	void account_state_time(std::chrono::steady_clock::time_point now) {
+		if(last_tick != std::chrono::steady_clock::time_point()) {
+			auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(now - last_tick);
+			metrics->state_time_us[power_state].fetch_add(elapsed.count(), std::memory_order_relaxed);
+		}
+		last_tick = now;
+	}
+
+	// Charge the time since the previous reading to under-clocking when the
+	// reading, which covers that time, was busy below the highest state
+	void account_underclocked(const UtilizationInputs &inputs, std::chrono::steady_clock::time_point now) {
+		bool busy = inputs.boost >= config.boost_utilization ||
+			(config.mem_enabled && inputs.mem_boost >= config.mem_boost_utilization);
+		if(busy && power_state > 0 && last_reading != std::chrono::steady_clock::time_point()) {
+			auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(now - last_reading);
+			metrics->underclocked_busy_us.fetch_add(elapsed.count(), std::memory_order_relaxed);
+		}
+		last_reading = now;
+	}
+
+	// Remember when a transition condition started to hold
+	void note_crossing(Transition direction, std::chrono::steady_clock::time_point now) {
+		if(crossing != direction) {
+			crossing = direction;
+			crossed_at = now;
+		}
+	}
+
+	// Count a transition and its delay from the threshold crossing
+	void record_transition(Transition direction) {
+		auto delay = std::chrono::duration_cast<std::chrono::microseconds>(device->now() - crossed_at);
+		metrics->transitions[direction].fetch_add(1, std::memory_order_relaxed);
+		metrics->transition_delay[direction]->observe(delay.count());
+		crossing = TRANSITION_NONE;
+	}
+
+	// Queue the readings behind this tick's decision
+	void record_sample(const UtilizationInputs &inputs) {
+		TraceRecord entry = {};
+		entry.time_us = std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::system_clock::now().time_since_epoch()).count();
+		entry.gpu_index = index;
+		entry.mem_clock = applied_clock;
+		entry.gpu = inputs.gpu;
+		entry.memory = inputs.memory;
+		entry.encoder = inputs.encoder;
+		entry.decoder = inputs.decoder;
+		entry.power_state = power_state;
+		if(metrics->power_sampled.load(std::memory_order_relaxed)) {
+			entry.power_mw = metrics->power_mw.load(std::memory_order_relaxed);
+		}
+		record_channel->record(entry);
+	}
+
+	static constexpr int power_field_count = 2;
+
+	// Power draw and the energy counter in one call, fails unless the power field is there
+	nvmlReturn_t read_power_fields(nvmlFieldValue_t *fields) {
+		memset(fields, 0, sizeof(nvmlFieldValue_t) * power_field_count);
+		fields[0].fieldId = NVML_FI_DEV_POWER_INSTANT;
+		fields[1].fieldId = NVML_FI_DEV_TOTAL_ENERGY_CONSUMPTION;
+		nvmlReturn_t result = timed(NVML_CALL_FIELD_VALUES, [&] { return device->get_field_values(power_field_count, fields); });
+		return result == NVML_SUCCESS ? fields[0].nvmlReturn : result;
+	}
+
+	// Read the power draw of this tick for the trace, metrics and governor
+	void sample_power() {
+		nvmlReturn_t result;
+		unsigned int power;
+
+		if(field_batch) {
+			nvmlFieldValue_t fields[power_field_count];
+			result = read_power_fields(fields);
+			if(result == NVML_SUCCESS) {
+				power = sample_value(fields[0].valueType, fields[0].value);
+				if(fields[1].nvmlReturn == NVML_SUCCESS) {
+					metrics->energy_mj.store(fields[1].value.ullVal, std::memory_order_relaxed);
+				}
+				publish_power(power);
+				return;
+			}
+			log_printf(LOG_WARN, "GPU%d: Field values failed, reading power on its own: %s", index, nvmlErrorString(result));
+			field_batch = false;
+			metrics->energy_sampled.store(false, std::memory_order_relaxed);
+		}
+
+		result = timed(NVML_CALL_POWER, [&] { return device->get_power_usage(&power); });
+		if(result != NVML_SUCCESS) {
+			log_printf(LOG_WARN, "GPU%d: Power draw not available: %s", index, nvmlErrorString(result));
+			power_sampling = false;
+			metrics->power_sampled.store(false, std::memory_order_relaxed);
+			return;
+		}
+		publish_power(power);
+	}
+
+	void sample_temperature() {
+		unsigned int temperature;
+		nvmlReturn_t result = timed(NVML_CALL_TEMPERATURE, [&] { return device->get_temperature(&temperature); });
+		if(result != NVML_SUCCESS) {
+			log_printf(LOG_WARN, "GPU%d: Temperature not available: %s", index, nvmlErrorString(result));
+			temperature_sampling = false;
+			metrics->temperature_sampled.store(false, std::memory_order_relaxed);
+			return;
+		}
+		metrics->temperature_c.store(temperature, std::memory_order_relaxed);
+		metrics->temperature_sampled.store(true, std::memory_order_relaxed);
+	}
+
+	void publish_power(unsigned int power) {
+		metrics->power_mw.store(power, std::memory_order_relaxed);
+		metrics->power_sampled.store(true, std::memory_order_relaxed);
+	}
+
+	// Take over runtime settings, the clock ladder and sampling setup stay as initialized
+	void apply_pending_config() {
+		std::unique_ptr<PowermizerConfig> updated(pending_config.exchange(nullptr, std::memory_order_acq_rel));
+		if(!updated) {
+			return;
+		}
+		if(config.control_policy != updated->control_policy) {
+			// Start the new controller from the current state
+			controller_started = false;
+		}
+		copy_runtime_settings(config, *updated);
+		log_printf(LOG_INFO, "GPU%d: Settings updated: boost %d%% / %d ms, low power %d%% / %d ms, boost policy %s",
+			index, config.boost_utilization, config.boost_activate_time,
+			config.low_power_utilization, config.low_power_activate_time, boost_policy_names[config.boost_policy]);
+	}
+
+	// Check for compute processes not seen on the previous call, the first
+	// of them goes to new_pid. Processes already running on the first call do not count.
+	bool detect_new_processes(unsigned int *new_pid) {
+		nvmlReturn_t result;
+		unsigned int count = process_buffer.size();
+		bool found = false;
+
+		result = timed(NVML_CALL_PROCESSES, [&] { return device->get_compute_running_processes(&count, process_buffer.data()); });
+		if(result == NVML_ERROR_INSUFFICIENT_SIZE) {
+			// Nothing was filled in, grow to the returned count with room for a few more and retry
+			process_buffer.resize(count + process_capacity);
+			known_pids.resize(process_buffer.size());
+			count = process_buffer.size();
+			result = timed(NVML_CALL_PROCESSES, [&] { return device->get_compute_running_processes(&count, process_buffer.data()); });
+		}
+		if(result != NVML_SUCCESS) {
+			log_printf(LOG_ERROR, "GPU%d: Failed to get compute processes: %s", index, nvmlErrorString(result));
+			return false;
+		}
+		auto known_end = known_pids.begin() + known_pid_count;
+
+		for(unsigned int i = 0; i < count && processes_seeded; i++) {
+			if(std::find(known_pids.begin(), known_end, process_buffer[i].pid) == known_end) {
+				log_printf(LOG_DEBUG, "GPU%d: Compute process %d started", index, process_buffer[i].pid);
+				if(!found) {
+					*new_pid = process_buffer[i].pid;
+				}
+				found = true;
+			}
+		}
+		for(unsigned int i = 0; i < count; i++) {
+			known_pids[i] = process_buffer[i].pid;
+		}
+		known_pid_count = count;
+		processes_seeded = true;
+		return found;
+	}
+
+	// Follow one workload at a time from its first compute process. A known
+	// workload starts at its learnt state, returns whether that state was applied.
+	bool track_workload(unsigned int new_pid, std::chrono::steady_clock::time_point now, int cap) {
+		if(workload_pid != 0 && std::find(known_pids.begin(), known_pids.begin() + known_pid_count, workload_pid) ==
+			known_pids.begin() + known_pid_count) {
+			finish_workload(now);
+		}
+		if(workload_pid != 0 || new_pid == 0) {
+			return false;
+		}
+		std::string workload = workload_cache->classify(new_pid);
+		if(workload.empty()) {
+			log_printf(LOG_DEBUG, "GPU%d: Cannot classify compute process %d", index, new_pid);
+			return false;
+		}
+
+		workload_pid = new_pid;
+		workload_class = workload;
+		workload_since = now;
+		workload_bandwidth = 0;
+		workload_steered = false;
+		for(int i = 0; i <= max_power_state; i++) {
+			workload_state_us[i] = metrics->state_time_us[i].load(std::memory_order_relaxed);
+		}
+
+		LearntWorkload learnt;
+		if(!workload_cache->lookup(name, workload_class, &learnt)) {
+			log_printf(LOG_DEBUG, "GPU%d: New workload %s", index, workload_class.c_str());
+			return false;
+		}
+		// Lowest clock at or above the learnt one, raised while the
+		// learnt bandwidth would leave it above the boost threshold
+		unsigned int threshold = config.mem_enabled ? config.mem_boost_utilization : config.boost_utilization;
+		int target_state = 0;
+		while(target_state < max_power_state && (unsigned int)clocks[target_state + 1] >= learnt.mem_clock) {
+			target_state++;
+		}
+		while(target_state > 0 && learnt.bandwidth * 100 >= threshold * (unsigned int)clocks[target_state]) {
+			target_state--;
+		}
+		target_state = std::max(target_state, cap);
+		log_printf(LOG_INFO, "GPU%d: Workload %s seen %u time(s), starting at %d MHz", index, workload_class.c_str(),
+			learnt.runs, clocks[target_state]);
+		if(target_state != power_state) {
+			Transition direction = target_state < power_state ? TRANSITION_BOOST : TRANSITION_LOWER;
+			note_crossing(direction, now);
+			if(!set_power_state(target_state)) {
+				return false;
+			}
+			record_transition(direction);
+		}
+		// Hysteresis carries on from the learnt state
+		last_update = now;
+		crossing = TRANSITION_NONE;
+		return true;
+	}
+
+	// Remember the state the workload spent the most time at. Short runs have
+	// not settled, and runs steered by the governor or hints say nothing.
+	void finish_workload(std::chrono::steady_clock::time_point now) {
+		account_state_time(now);
+		auto runtime = std::chrono::duration_cast<std::chrono::milliseconds>(now - workload_since);
+		workload_pid = 0;
+		if(runtime.count() < learn_min_runtime_ms || workload_steered) {
+			log_printf(LOG_DEBUG, "GPU%d: Workload %s ended after %lld ms, not learnt", index, workload_class.c_str(),
+				(long long)runtime.count());
+			return;
+		}
+		int settled = 0;
+		unsigned long long settled_us = 0;
+		for(int i = 0; i <= max_power_state; i++) {
+			unsigned long long spent = metrics->state_time_us[i].load(std::memory_order_relaxed) - workload_state_us[i];
+			if(spent > settled_us) {
+				settled = i;
+				settled_us = spent;
+			}
+		}
+		workload_cache->learn(name, workload_class, clocks[settled], workload_bandwidth);
+		log_printf(LOG_INFO, "GPU%d: Workload %s settled at %d MHz, peak bandwidth %u MHz", index, workload_class.c_str(),
+			clocks[settled], workload_bandwidth);
+	}
+
+	// Find the MIG GPU instances, their GPM activity stands in for the
+	// utilization NVML does not report on a partitioned GPU
+	void init_mig() {
+		std::vector<MigInstanceInfo> found;
+		mig_slices.clear();
+		if(device->get_mig_instances(found) != NVML_SUCCESS || found.empty()) {
+			return;
+		}
+		unsigned int gpm_supported = 0;
+		nvmlReturn_t result = device->get_gpm_support(&gpm_supported);
+		if(result != NVML_SUCCESS || !gpm_supported) {
+			log_printf(LOG_WARN, "GPU%d: MIG enabled but GPM not available, load of the instances not visible: %s",
+				index, nvmlErrorString(result != NVML_SUCCESS ? result : NVML_ERROR_NOT_SUPPORTED));
+			return;
+		}
+		for(const MigInstanceInfo &info : found) {
+			auto slice = std::make_unique<MigSlice>();
+			slice->info = info;
+			slice->info.sm_count = std::max(info.sm_count, 1U);
+			if(!slice->gpm.allocated()) {
+				log_printf(LOG_WARN, "GPU%d: Failed to allocate GPM samples, MIG instances not sampled", index);
+				mig_slices.clear();
+				return;
+			}
+			log_printf(LOG_DEBUG, "GPU%d: MIG GPU instance %u: %u SMs", index, info.gpu_instance_id, info.sm_count);
+			mig_slices.push_back(std::move(slice));
+		}
+		log_printf(LOG_INFO, "GPU%d: MIG enabled, %d GPU instance(s), activity aggregated by %s", index,
+			(int)mig_slices.size(), mig_aggregate_names[config.mig_aggregate]);
+		if(config.sample_stat != SAMPLE_STAT_NONE) {
+			log_printf(LOG_WARN, "GPU%d: Utilization history not available with MIG, using point samples", index);
+			config.sample_stat = SAMPLE_STAT_NONE;
+		}
+	}
+
+	// Set up device-wide GPM sampling, its two sample buffers are reused every tick
+	bool init_gpm() {
+		unsigned int gpm_supported = 0;
+		if(device->get_gpm_support(&gpm_supported) != NVML_SUCCESS || !gpm_supported) {
+			return false;
+		}
+		auto pair = std::make_unique<GpmSamplePair>();
+		if(!pair->allocated()) {
+			return false;
+		}
+		device_gpm = std::move(pair);
+		log_printf(LOG_DEBUG, "GPU%d: Deciding on GPM DRAM bandwidth, SM occupancy reported as GPU utilization", index);
+		if(config.sample_stat != SAMPLE_STAT_NONE) {
+			log_printf(LOG_WARN, "GPU%d: Utilization history not used with GPM, using point samples", index);
+			config.sample_stat = SAMPLE_STAT_NONE;
+		}
+		return true;
+	}
+
+	// GPM metrics between two samples, in the order of the ids
+	bool gpm_metrics(nvmlGpmSample_t older, nvmlGpmSample_t newer, const unsigned int *ids, double *values, unsigned int count) {
+		nvmlGpmMetricsGet_t query = {};
+		query.version = NVML_GPM_METRICS_GET_VERSION;
+		query.numMetrics = count;
+		query.sample1 = older;
+		query.sample2 = newer;
+		for(unsigned int i = 0; i < count; i++) {
+			query.metrics[i].metricId = ids[i];
+		}
+		nvmlReturn_t result = nvmlGpmMetricsGet(&query);
+		for(unsigned int i = 0; i < count && result == NVML_SUCCESS; i++) {
+			result = query.metrics[i].nvmlReturn;
+			values[i] = query.metrics[i].value;
+		}
+		if(result != NVML_SUCCESS) {
+			log_printf(LOG_ERROR, "GPU%d: Failed to get GPM metrics: %s", index, nvmlErrorString(result));
+			return false;
+		}
+		return true;
+	}
+
+	// GPM reports DRAM bandwidth against the peak at the highest memory clock,
+	// scale it to the applied clock so a lowered clock can still reach the boost threshold
+	unsigned int dram_at_applied_clock(double dram) {
+		if(applied_clock > 0) {
+			dram = dram * clocks[0] / applied_clock;
+		}
+		return std::min(lround(dram), 100L);
+	}
+
+	// Encoder and decoder utilization, 0 when not read
+	void read_coder_utilization(unsigned int *encoder_utilization, unsigned int *decoder_utilization) {
+		nvmlReturn_t result;
+		unsigned int sampling_period;
+
+		*encoder_utilization = 0;
+		*decoder_utilization = 0;
+		if(!config.en_de_coder_enabled) {
+			return;
+		}
+		result = timed(NVML_CALL_ENCODER, [&] { return device->get_encoder_utilization(encoder_utilization, &sampling_period); });
+		if(result != NVML_SUCCESS) {
+			log_printf(LOG_ERROR, "GPU%d: Failed to get encoder utilization: %s", index, nvmlErrorString(result));
+			*encoder_utilization = 0;
+		}
+
+		result = timed(NVML_CALL_DECODER, [&] { return device->get_decoder_utilization(decoder_utilization, &sampling_period); });
+		if(result != NVML_SUCCESS) {
+			log_printf(LOG_ERROR, "GPU%d: Failed to get decoder utilization: %s", index, nvmlErrorString(result));
+			*decoder_utilization = 0;
+		}
+	}
+
+	// DRAM bandwidth decides, busy SMs alone keep no memory clock up
+	bool read_gpm_utilization(UtilizationInputs *inputs) {
+		nvmlGpmSample_t older = device_gpm->older();
+		nvmlGpmSample_t newer = device_gpm->next();
+		nvmlReturn_t result = timed(NVML_CALL_GPM_SAMPLE, [&] { return device->get_gpm_sample(newer); });
+		if(result != NVML_SUCCESS) {
+			log_printf(LOG_ERROR, "GPU%d: Failed to get GPM sample: %s", index, nvmlErrorString(result));
+			return false;
+		}
+		if(!device_gpm->advance()) {
+			// The first sample only sets the baseline
+			return false;
+		}
+
+		static const unsigned int ids[2] = {NVML_GPM_METRIC_DRAM_BW_UTIL, NVML_GPM_METRIC_SM_OCCUPANCY};
+		double values[2];
+		if(!gpm_metrics(older, newer, ids, values, 2)) {
+			return false;
+		}
+		unsigned int encoder_utilization, decoder_utilization;
+		read_coder_utilization(&encoder_utilization, &decoder_utilization);
+
+		inputs->memory = dram_at_applied_clock(values[0]);
+		inputs->gpu = std::min(lround(values[1]), 100L);
+		inputs->boost = std::max(inputs->memory, std::max(encoder_utilization, decoder_utilization));
+		inputs->low_power = inputs->boost;
+		inputs->mem_boost = inputs->memory;
+		inputs->mem_low_power = inputs->memory;
+		inputs->encoder = encoder_utilization;
+		inputs->decoder = decoder_utilization;
+		return true;
+	}
+
+	// Activity of the MIG instances since the previous tick, each instance
+	// keeps two samples and overwrites the older one
+	bool read_mig_utilization(UtilizationInputs *inputs) {
+		double graphics_max = 0, dram_max = 0;
+		double graphics_sum = 0, dram_sum = 0;
+		unsigned int sm_total = 0;
+		bool primed = true;
+
+		for(auto &slice : mig_slices) {
+			nvmlGpmSample_t older = slice->gpm.older();
+			nvmlGpmSample_t newer = slice->gpm.next();
+			nvmlReturn_t result = timed(NVML_CALL_GPM_MIG_SAMPLE, [&] {
+				return device->get_gpm_mig_sample(slice->info.gpu_instance_id, newer);
+			});
+			if(result != NVML_SUCCESS) {
+				// Most likely the layout changed, look again on the next tick
+				log_printf(LOG_WARN, "GPU%d: Failed to sample GPU instance %u, rescanning MIG: %s",
+					index, slice->info.gpu_instance_id, nvmlErrorString(result));
+				mig_changed = true;
+				return false;
+			}
+			if(!slice->gpm.advance()) {
+				primed = false;
+				continue;
+			}
+
+			static const unsigned int ids[2] = {NVML_GPM_METRIC_GRAPHICS_UTIL, NVML_GPM_METRIC_DRAM_BW_UTIL};
+			double values[2];
+			if(!gpm_metrics(older, newer, ids, values, 2)) {
+				return false;
+			}
+			double graphics = values[0], dram = values[1];
+			graphics_max = std::max(graphics_max, graphics);
+			dram_max = std::max(dram_max, dram);
+			graphics_sum += graphics * slice->info.sm_count;
+			dram_sum += dram * slice->info.sm_count;
+			sm_total += slice->info.sm_count;
+		}
+		if(!primed) {
+			// The first samples only set the baseline
+			return false;
+		}
+
+		double graphics = graphics_max, dram = dram_max;
+		if(config.mig_aggregate == MIG_AGGREGATE_WEIGHTED) {
+			graphics = graphics_sum / sm_total;
+			dram = dram_sum / sm_total;
+		}
+		inputs->gpu = std::min(lround(graphics), 100L);
+		inputs->memory = dram_at_applied_clock(dram);
+		inputs->boost = inputs->gpu;
+		inputs->low_power = inputs->gpu;
+		inputs->mem_boost = inputs->memory;
+		inputs->mem_low_power = inputs->memory;
+		return true;
+	}
+
+	// Single point sample of GPU, memory, encoder and decoder utilization
+	bool read_utilization(UtilizationInputs *inputs) {
+		nvmlReturn_t result;
+		nvmlUtilization_t utilization;
+		unsigned int encoder_utilization;
+		unsigned int decoder_utilization;
+
+		result = timed(NVML_CALL_UTILIZATION, [&] { return device->get_utilization_rates(&utilization); });
+		if(result != NVML_SUCCESS) {
+			log_printf(LOG_ERROR, "GPU%d: Failed to get utilization: %s", index, nvmlErrorString(result));
+			return false;
+		}
+		
+		read_coder_utilization(&encoder_utilization, &decoder_utilization);
+
+		inputs->boost = std::max(utilization.gpu, std::max(encoder_utilization, decoder_utilization));
+		inputs->low_power = inputs->boost;
+		inputs->mem_boost = utilization.memory;
+		inputs->mem_low_power = utilization.memory;
+		inputs->gpu = utilization.gpu;
+		inputs->memory = utilization.memory;
+		inputs->encoder = encoder_utilization;
+		inputs->decoder = decoder_utilization;
+		return true;
+	}
+
+	// Append samples newer than the last one seen to the history
+	bool fetch_samples(nvmlSamplingType_t type, SampleHistory &samples, const char *what) {
+		nvmlReturn_t result;
+		nvmlValueType_t value_type;
+		unsigned int count = sample_buffer_size;
+
+		result = timed(NVML_CALL_SAMPLES, [&] {
+			return device->get_samples(type, samples.last_timestamp(), &value_type, &count, sample_buffer.get());
+		});
+		if(result == NVML_ERROR_NOT_FOUND) {
+			// Nothing new since last call
+			return true;
+		}
+		if(result != NVML_SUCCESS) {
+			log_printf(LOG_ERROR, "GPU%d: Failed to get %s samples: %s", index, what, nvmlErrorString(result));
+			return false;
+		}
+
+		for(unsigned int i = 0; i < count; i++) {
+			if(sample_buffer[i].timeStamp > samples.last_timestamp()) {
+				samples.push(sample_buffer[i].timeStamp, sample_value(value_type, sample_buffer[i].sampleValue));
+			}
+		}
+		return true;
+	}
+
+	// Window statistic of one history for boost and low power windows
+	void window_statistic(SampleHistory &samples, unsigned int *boost_out, unsigned int *low_power_out) {
+		unsigned int value;
+
+		if(samples.statistic(config.boost_activate_time * 1000ULL, config.sample_stat, config.sample_percentile, &value)) {
+			*boost_out = std::max(*boost_out, value);
+		}
+		if(samples.statistic(config.low_power_activate_time * 1000ULL, config.sample_stat, config.sample_percentile, &value)) {
+			*low_power_out = std::max(*low_power_out, value);
+		}
+	}
+
+	// Utilization statistics over the boost and low power time windows
+	bool read_utilization_history(UtilizationInputs *inputs) {
+		if(!fetch_samples(NVML_GPU_UTILIZATION_SAMPLES, gpu_samples, "utilization")) {
+			return false;
+		}
+		if(gpu_samples.last_timestamp() == 0) {
+			// No history yet
+			return false;
+		}
+		if(config.en_de_coder_enabled) {
+			// Coder failures are not fatal, same as point sampling
+			fetch_samples(NVML_ENC_UTILIZATION_SAMPLES, encoder_samples, "encoder utilization");
+			fetch_samples(NVML_DEC_UTILIZATION_SAMPLES, decoder_samples, "decoder utilization");
+		}
+		if(config.mem_enabled) {
+			if(!fetch_samples(NVML_MEMORY_UTILIZATION_SAMPLES, memory_samples, "memory utilization")) {
+				return false;
+			}
+		}
+
+		inputs->boost = 0;
+		inputs->low_power = 0;
+		window_statistic(gpu_samples, &inputs->boost, &inputs->low_power);
+		if(config.en_de_coder_enabled) {
+			window_statistic(encoder_samples, &inputs->boost, &inputs->low_power);
+			window_statistic(decoder_samples, &inputs->boost, &inputs->low_power);
+		}
+		if(config.mem_enabled) {
+			inputs->mem_boost = 0;
+			inputs->mem_low_power = 0;
+			window_statistic(memory_samples, &inputs->mem_boost, &inputs->mem_low_power);
+		}
+		inputs->gpu = gpu_samples.last_value();
+		inputs->memory = memory_samples.last_value();
+		inputs->encoder = encoder_samples.last_value();
+		inputs->decoder = decoder_samples.last_value();
+		return true;
+	}
+
+	// States to skip for a utilization above its boost threshold,
+	// the fraction of the remaining headroom rounded up
+	int proportional_steps(unsigned int utilization, unsigned int threshold) {
+		if(utilization < threshold) {
+			return 0;
+		}
+		unsigned int headroom = 100 - std::min(threshold, 100U);
+		if(headroom == 0) {
+			return power_state;
+		}
+		unsigned int excess = std::min(utilization, 100U) - threshold;
+		return (power_state * excess + headroom - 1) / headroom;
+	}
+
+	// Pick the power state to boost to according to the boost policy
+	int boost_target(const UtilizationInputs &inputs) {
+		switch(config.boost_policy) {
+		case BOOST_JUMP:
+			return 0;
+		case BOOST_PROPORTIONAL: {
+			int steps = proportional_steps(inputs.boost, config.boost_utilization);
+			if(config.mem_enabled) {
+				steps = std::max(steps, proportional_steps(inputs.mem_boost, config.mem_boost_utilization));
+			}
+			return power_state - std::min(std::max(steps, 1), power_state);
+		}
+		case BOOST_STEP:
+		default:
+			return power_state - 1;
+		}
+	}
+
+	// Continuous controllers. Both track the last transition in last_update
+	// and treat the boost and low power times as minimum residency.
+	void control(const UtilizationInputs &inputs, std::chrono::steady_clock::time_point now, int cap) {
+		double dt = controller_started ? std::chrono::duration<double>(now - last_control).count() : 0.0;
+		last_control = now;
+
+		int target_state = power_state;
+		if(config.control_policy == POLICY_EWMA) {
+			// Smoothing factor for the time since the previous sample
+			double alpha = controller_started ? 1.0 - exp(-dt * 1000.0 / config.smoothing_time) : 1.0;
+			smoothed_utilization += alpha * ((double)inputs.boost - smoothed_utilization);
+			smoothed_mem_utilization += alpha * ((double)inputs.mem_boost - smoothed_mem_utilization);
+
+			if(smoothed_utilization >= config.boost_utilization ||
+				(config.mem_enabled && smoothed_mem_utilization >= config.mem_boost_utilization)) {
+				target_state = boost_target(inputs);
+			} else if(smoothed_utilization <= config.low_power_utilization &&
+				(!config.mem_enabled || smoothed_mem_utilization <= config.mem_low_power_utilization)) {
+				target_state = power_state + 1;
+			}
+		} else {
+			target_state = pid_target(inputs, dt);
+		}
+		controller_started = true;
+
+		target_state = std::min(std::max(target_state, cap), max_power_state);
+		if(target_state == power_state) {
+			crossing = TRANSITION_NONE;
+			return;
+		}
+
+		Transition direction = target_state < power_state ? TRANSITION_BOOST : TRANSITION_LOWER;
+		unsigned int residency = direction == TRANSITION_BOOST ? config.boost_activate_time : lower_residency();
+		note_crossing(direction, now);
+		if(direction == TRANSITION_LOWER) {
+			// Lowering stays gradual and waits for a predicted load
+			if(now < predicted_until) {
+				return;
+			}
+			target_state = power_state + 1;
+		}
+		if(now - last_update < std::chrono::milliseconds(residency)) {
+			pending_deadline = last_update + std::chrono::milliseconds(residency);
+			return;
+		}
+		if(set_power_state(target_state)) {
+			last_update = now;
+			record_transition(direction);
+		}
+	}
+
+	// Position on the power state ladder from a PID on the utilization error,
+	// the integral holds the position while utilization is on target
+	int pid_target(const UtilizationInputs &inputs, double dt) {
+		const double kp = config.pid_gains[0], ki = config.pid_gains[1], kd = config.pid_gains[2];
+		unsigned int target = config.target_utilization > 0 ? config.target_utilization :
+			(config.boost_utilization + config.low_power_utilization) / 2;
+		double error = ((double)inputs.boost - target) / 100.0;
+		if(config.mem_enabled) {
+			unsigned int mem_target = (config.mem_boost_utilization + config.mem_low_power_utilization) / 2;
+			error = std::max(error, ((double)inputs.mem_boost - mem_target) / 100.0);
+		}
+
+		if(!controller_started) {
+			// Bumpless start from the current state
+			pid_integral = ki > 0 ? (max_power_state - power_state) / ki : 0.0;
+			pid_error = error;
+		}
+		double derivative = dt > 0 ? (error - pid_error) / dt : 0.0;
+		pid_error = error;
+
+		// Stop integrating while the output is pinned at an end of the ladder
+		double integral = pid_integral + error * dt;
+		double position = max_power_state - (kp * error + ki * integral + kd * derivative);
+		if((position < 0 && error > 0) || (position > max_power_state && error < 0)) {
+			position = max_power_state - (kp * error + ki * pid_integral + kd * derivative);
+		} else {
+			pid_integral = integral;
+		}
+		position = std::min(std::max(position, 0.0), (double)max_power_state);
+		// Dead band around the current state against flapping
+		if(fabs(position - power_state) < 0.75) {
+			return power_state;
+		}
+		return lround(position);
+	}
+
+	// Time to hold the current state before lowering from it
+	unsigned int lower_residency() {
+		if(calibrated_residency_ms.empty()) {
+			return config.low_power_activate_time;
+		}
+		// Capped, so that slow transitions delay lowering rather than disable it
+		unsigned int calibrated = std::min(calibrated_residency_ms[power_state],
+			config.low_power_activate_time * calibration_residency_factor);
+		return std::max(config.low_power_activate_time, calibrated);
+	}
+
+	// Move to a state and wait until the memory clock reports it
+	bool measure_transition(int new_state, CalibrationTable &table) {
+		static constexpr unsigned int settle_timeout_ms = 2000;
+		unsigned int new_clock = clocks[new_state];
+		auto start = std::chrono::steady_clock::now();
+		BusyScope busy(busy_since, start);
+		nvmlReturn_t result = timed(NVML_CALL_SET_MEM_CLOCKS, [&] { return device->set_memory_locked_clocks(new_clock, new_clock); });
+		auto set_done = std::chrono::steady_clock::now();
+		if(result != NVML_SUCCESS) {
+			log_printf(LOG_ERROR, "GPU%d: Failed to set memory clocks: %s", index, nvmlErrorString(result));
+			return false;
+		}
+		unsigned int current_clock = 0;
+		while(timed(NVML_CALL_CLOCK_INFO, [&] { return device->get_clock_info(NVML_CLOCK_MEM, &current_clock); }) == NVML_SUCCESS &&
+			current_clock != new_clock && std::chrono::steady_clock::now() - start < std::chrono::milliseconds(settle_timeout_ms)) {
+			std::this_thread::sleep_for(std::chrono::microseconds(200));
+		}
+		auto settled = std::chrono::steady_clock::now();
+		if(is_lost()) {
+			log_printf(LOG_ERROR, "GPU%d: Lost while calibrating", index);
+			return false;
+		}
+
+		CalibrationEntry measured;
+		measured.set_us = std::chrono::duration_cast<std::chrono::microseconds>(set_done - start).count();
+		measured.settle_us = std::chrono::duration_cast<std::chrono::microseconds>(settled - start).count();
+		if(current_clock != new_clock) {
+			// Not a settle time, keep whatever earlier runs measured
+			log_printf(LOG_WARN, "GPU%d: Memory clock at %d MHz %d ms after setting %d MHz, not recorded", index, current_clock,
+				settle_timeout_ms, new_clock);
+		} else {
+			log_printf(LOG_DEBUG, "GPU%d: %d -> %d MHz: set %llu us, settled %llu us", index, applied_clock, new_clock,
+				measured.set_us, measured.settle_us);
+			table.record(name, applied_clock, new_clock, measured);
+		}
+		applied_clock = new_clock;
+		power_state = new_state;
+		metrics->memory_clock.store(applied_clock, std::memory_order_relaxed);
+		metrics->power_state.store(power_state, std::memory_order_relaxed);
+		return true;
+	}
+
+	// Hold off re-syncing until a new lock had time to show, as calibrated if known
+	void start_settling(int from_clock, int to_clock) {
+		auto settle = std::chrono::microseconds((unsigned long long)default_settle_ms * 1000);
+		auto calibrated = calibrated_settle_us.find({from_clock, to_clock});
+		if(calibrated != calibrated_settle_us.end()) {
+			settle = std::chrono::microseconds(calibrated->second);
+		}
+		settle_deadline = device->now() + settle;
+	}
+
+	// Lock memory clock to the given power state
+	bool set_power_state(int new_state) {
+		nvmlReturn_t result;
+		int new_clock = clocks[new_state];
+
+		log_printf(LOG_DEBUG, "GPU%d: %s clock to %d", index, new_state < power_state ? "Boosting" : "Lowering", new_clock);
+		if(new_clock != applied_clock) {
+			result = timed(NVML_CALL_SET_MEM_CLOCKS, [&] { return device->set_memory_locked_clocks(new_clock, new_clock); });
+			if(result != NVML_SUCCESS) {
+				log_printf(LOG_ERROR, "GPU%d: Failed to set memory clocks: %s", index, nvmlErrorString(result));
+				return false;
+			}
+			start_settling(applied_clock, new_clock);
+			applied_clock = new_clock;
+			metrics->memory_clock.store(applied_clock, std::memory_order_relaxed);
+		}
+		if(config.gpu_clocks_enabled && !set_gpu_clock_range(new_state)) {
+			return false;
+		}
+		power_state = new_state;
+		metrics->power_state.store(power_state, std::memory_order_relaxed);
+		if(group && group->leads(group_slot)) {
+			group->set_state(power_state);
+		}
+		return true;
+	}
+
+	// Take the state the group's deciding member chose, within this GPU's
+	// ladder and cap. The controller restarts should this member come to decide.
+	void follow_group(std::chrono::steady_clock::time_point now, int cap) {
+		int target_state = std::min(std::max(group->get_state(), cap), max_power_state);
+		if(target_state != power_state) {
+			Transition direction = target_state < power_state ? TRANSITION_BOOST : TRANSITION_LOWER;
+			note_crossing(direction, now);
+			if(!set_power_state(target_state)) {
+				return;
+			}
+			record_transition(direction);
+		}
+		last_update = now;
+		crossing = TRANSITION_NONE;
+		controller_started = false;
+	}
+
+	// Supported memory clocks, highest first
+	bool get_supported_mem_clocks(std::vector<unsigned int> &mem_clocks) {
+		nvmlReturn_t result;
+		unsigned int count = 0;
+
+		// Query the count first, the list length differs between SKUs
+		result = device->get_supported_memory_clocks(&count, NULL);
+		if(result != NVML_SUCCESS && result != NVML_ERROR_INSUFFICIENT_SIZE) {
+			log_printf(LOG_ERROR, "GPU%d: Failed to get supported memory clocks: %s", index, nvmlErrorString(result));
+			return false;
+		}
+
+		mem_clocks.resize(count);
+		result = device->get_supported_memory_clocks(&count, mem_clocks.data());
+		if(result != NVML_SUCCESS || count == 0) {
+			log_printf(LOG_ERROR, "GPU%d: Failed to get supported memory clocks: %s", index, nvmlErrorString(result));
+			return false;
+		}
+		mem_clocks.resize(count);
+		std::sort(mem_clocks.begin(), mem_clocks.end(), std::greater<unsigned int>());
+		return true;
+	}
+
+	// Supported graphics clocks at a memory clock, highest first
+	bool get_supported_gpu_clocks(unsigned int mem_clock, std::vector<unsigned int> &gpu_clocks) {
+		nvmlReturn_t result;
+		unsigned int count = 0;
+
+		result = device->get_supported_graphics_clocks(mem_clock, &count, NULL);
+		if(result != NVML_SUCCESS && result != NVML_ERROR_INSUFFICIENT_SIZE) {
+			log_printf(LOG_ERROR, "GPU%d: Failed to get supported graphics clocks: %s", index, nvmlErrorString(result));
+			return false;
+		}
+
+		gpu_clocks.resize(count);
+		result = device->get_supported_graphics_clocks(mem_clock, &count, gpu_clocks.data());
+		if(result != NVML_SUCCESS || count == 0) {
+			log_printf(LOG_ERROR, "GPU%d: Failed to get supported graphics clocks: %s", index, nvmlErrorString(result));
+			return false;
+		}
+		gpu_clocks.resize(count);
+		std::sort(gpu_clocks.begin(), gpu_clocks.end(), std::greater<unsigned int>());
+		return true;
+	}
+
+	// The highest state pins graphics clocks high to skip the DVFS ramp,
+	// the lowest caps them low, the others leave the full range to DVFS
+	bool build_gpu_clock_ranges() {
+		std::vector<unsigned int> gpu_clocks;
+
+		for(int i = 0; i <= max_power_state; i++) {
+			if(!get_supported_gpu_clocks(clocks[i], gpu_clocks)) {
+				return false;
+			}
+
+			unsigned int lowest = gpu_clocks.back();
+			unsigned int highest = gpu_clocks.front();
+			ClockRange range = {lowest, highest};
+			if(i == 0) {
+				range.min = config.gpu_boost_clock > 0 ? std::min(std::max(config.gpu_boost_clock, lowest), highest) : highest;
+			}
+			if(i == max_power_state && i > 0) {
+				range.max = config.gpu_low_power_clock > 0 ? std::min(std::max(config.gpu_low_power_clock, lowest), highest) : lowest;
+			}
+			gpu_clock_ranges.push_back(range);
+			log_printf(LOG_DEBUG, "GPU%d: Power state %d: memory %d MHz, graphics %d-%d MHz", index, i, clocks[i], range.min, range.max);
+		}
+		return true;
+	}
+
+	// Lock graphics clocks to the range of the given power state
+	bool set_gpu_clock_range(int state) {
+		nvmlReturn_t result;
+		const ClockRange &range = gpu_clock_ranges[state];
+
+		if(range.min == applied_gpu_clocks.min && range.max == applied_gpu_clocks.max) {
+			return true;
+		}
+		result = timed(NVML_CALL_SET_GPU_CLOCKS, [&] { return device->set_gpu_locked_clocks(range.min, range.max); });
+		if(result != NVML_SUCCESS) {
+			log_printf(LOG_ERROR, "GPU%d: Failed to set graphics clocks: %s", index, nvmlErrorString(result));
+			return false;
+		}
+		applied_gpu_clocks = range;
+		return true;
+	}
+
+	bool read_memory_clock(unsigned int *clock) {
+		nvmlReturn_t result;
+
+		result = timed(NVML_CALL_CLOCK_INFO, [&] { return device->get_clock_info(NVML_CLOCK_MEM, clock); });
+		if(result != NVML_SUCCESS) {
+			log_printf(LOG_ERROR, "GPU%d: Failed to get memory clock: %s", index, nvmlErrorString(result));
+			return false;
+		}
+		return true;
+	}
+
+	// Power state whose clock is closest to the given one
+	int nearest_power_state(unsigned int clock) {
+		int nearest = 0;
+		for(int i = 1; i <= max_power_state; i++) {
+			if(abs(clocks[i] - (int)clock) < abs(clocks[nearest] - (int)clock)) {
+				nearest = i;
+			}
+		}
+		return nearest;
+	}
+
+	// Re-sync power state when the memory clock no longer matches our lock
+	void sync_applied_clock(std::chrono::steady_clock::time_point now) {
+		unsigned int current_clock;
+
+		if(clock_events && !clock_changed) {
+			return;
+		}
+		// A stale reading right after our own lock is no external change, check once settled
+		if(now < settle_deadline) {
+			return;
+		}
+		clock_changed = false;
+		if(!read_memory_clock(&current_clock) || (int)current_clock == applied_clock) {
+			return;
+		}
+
+		int state = nearest_power_state(current_clock);
+		log_printf(LOG_WARN, "GPU%d: Memory clock changed externally from %d to %d MHz, adopting power state %d",
+			index, applied_clock, current_clock, state);
+		power_state = state;
+		applied_clock = current_clock;
+		metrics->power_state.store(power_state, std::memory_order_relaxed);
+		metrics->memory_clock.store(applied_clock, std::memory_order_relaxed);
+		// Restart hysteresis from the adopted state
+		last_update = now;
+	}
+
+	// Sample at the shortest interval near a threshold or while a transition
+	// is pending. Back off exponentially while idle at the lowest state or
+	// busy at the highest, where no reading can change the decision soon.
+	void adapt_sampling(const UtilizationInputs &inputs, std::chrono::steady_clock::time_point now) {
+		if(max_period_ms <= min_period_ms) {
+			return;
+		}
+		auto near = [](unsigned int value, unsigned int threshold) {
+			return value + adaptive_margin >= threshold && value <= threshold + adaptive_margin;
+		};
+		// Only thresholds that can still move the state count
+		bool near_boost = power_state > 0 && (near(inputs.boost, config.boost_utilization) ||
+			(config.mem_enabled && near(inputs.mem_boost, config.mem_boost_utilization)));
+		bool near_low = power_state < max_power_state && (near(inputs.low_power, config.low_power_utilization) ||
+			(config.mem_enabled && near(inputs.mem_low_power, config.mem_low_power_utilization)));
+		bool near_threshold = near_boost || near_low;
+		bool idle = power_state == max_power_state && inputs.low_power < config.low_power_utilization &&
+			(!config.mem_enabled || inputs.mem_low_power < config.mem_low_power_utilization);
+		bool saturated = power_state == 0 && inputs.low_power > config.low_power_utilization;
+
+		unsigned int period;
+		if(near_threshold || crossing != TRANSITION_NONE) {
+			period = min_period_ms;
+		} else if(idle || saturated) {
+			period = std::min(current_period_ms * 2, max_period_ms);
+		} else {
+			period = std::min(std::max(sampling_period_ms, min_period_ms), max_period_ms);
+		}
+		if(period != current_period_ms) {
+			log_printf(LOG_DEBUG, "GPU%d: Sampling every %u ms", index, period);
+			current_period_ms = period;
+			metrics->sampling_period_ms.store(period, std::memory_order_relaxed);
+		}
+		next_sample = now + std::chrono::milliseconds(period);
+	}
+
+	void schedule_next_sample(std::chrono::steady_clock::time_point now) {
+		auto period = std::chrono::milliseconds(current_period_ms);
+		next_sample += period;
+		// Skip missed slots instead of bursting to catch up
+		if(next_sample <= now) {
+			next_sample = now + period;
+		}
+	}
+
+	// Target device
+	std::unique_ptr<GpuDevice> device;
+	int index;
+	std::string name;
+	std::string bus_id;
+	std::string bus_id_legacy;
+	std::string uuid;
+
+	// Config vars
+	PowermizerConfig config;
+	std::vector<int> clocks = {};
+	bool supported = true;
+	bool clocks_reset = false;
+
+	// Process vars
+	int power_state = 0;
+	int max_power_state = 0;
+	int applied_clock = 0;
+	std::vector<ClockRange> gpu_clock_ranges;
+	ClockRange applied_gpu_clocks = {0, 0};
+	unsigned int max_utilization;
+	std::chrono::steady_clock::time_point last_update;
+
+	// Utilization history vars
+	std::unique_ptr<nvmlSample_t[]> sample_buffer;
+	unsigned int sample_buffer_size = 0;
+	SampleHistory gpu_samples;
+	SampleHistory encoder_samples;
+	SampleHistory decoder_samples;
+	SampleHistory memory_samples;
+
+	// Predictive boost vars, grown only when more processes run than ever before
+	static constexpr unsigned int process_capacity = 64;
+	std::vector<nvmlProcessInfo_t> process_buffer = std::vector<nvmlProcessInfo_t>(process_capacity);
+	std::vector<unsigned int> known_pids = std::vector<unsigned int>(process_capacity);
+	unsigned int known_pid_count = 0;
+	bool processes_seeded = false;
+	std::chrono::steady_clock::time_point predicted_until;
+
+	// Learning vars, the tracked workload and its state times when it started
+	static constexpr long long learn_min_runtime_ms = 30000;
+	WorkloadCache *workload_cache = nullptr;
+	unsigned int workload_pid = 0;
+	std::string workload_class;
+	std::chrono::steady_clock::time_point workload_since;
+	std::unique_ptr<unsigned long long[]> workload_state_us;
+	unsigned int workload_bandwidth = 0;
+	bool workload_steered = false;
+
+	// Controller vars
+	bool controller_started = false;
+	std::chrono::steady_clock::time_point last_control;
+	double smoothed_utilization = 0;
+	double smoothed_mem_utilization = 0;
+	double pid_integral = 0;
+	double pid_error = 0;
+
+	// Recording vars
+	TraceChannel *record_channel = nullptr;
+
+	// Group vars, set before the instance runs
+	std::shared_ptr<GpuGroup> group;
+	unsigned int group_slot = 0;
+	bool group_leading = false;
+
+	// Power vars, readings shared through the metrics
+	bool power_sampling = false;
+	unsigned int power_period_ms = 0;
+	std::chrono::steady_clock::time_point next_power_sample;
+	bool temperature_sampling = false;
+	unsigned int temperature_period_ms = 0;
+	std::chrono::steady_clock::time_point next_temperature_sample;
+	bool field_batch = false;
+
+	// Runtime control vars, written by other threads
+	std::mutex update_mutex;
+	PowermizerConfig shadow_config;
+	std::atomic<PowermizerConfig *> pending_config{nullptr};
+	std::atomic<long long> boost_until_ns{0};
+	std::atomic<int> pinned_state{-1};
+	std::atomic<int> state_cap{0};
+
+	// Metrics vars
+	std::shared_ptr<InstanceMetrics> metrics;
+	std::chrono::steady_clock::time_point last_tick;
+	std::chrono::steady_clock::time_point last_reading;
+	Transition crossing = TRANSITION_NONE;
+	std::chrono::steady_clock::time_point crossed_at;
+
+	// Benchmark vars, null unless benchmarking
+	std::unique_ptr<BenchSamples> bench;
+
+	// Watchdog vars, start of the current process() call in ns or 0. A GPU
+	// that stalled a serial tick is only probed again after degraded_until
+	static constexpr unsigned int degraded_probe_ms = 10000;
+	std::atomic<long long> busy_since{0};
+	std::chrono::steady_clock::time_point degraded_until;
+
+	// Reattach vars, the backoff doubles per failed try
+	static constexpr unsigned int retry_initial_ms = 1000;
+	static constexpr unsigned int retry_max_ms = 60000;
+	unsigned int retry_backoff_ms = retry_initial_ms;
+	std::chrono::steady_clock::time_point retry_at;
+
+	// Calibration vars, minimum time in each state before lowering, empty if not calibrated
+	static constexpr double calibration_stall_share = 0.01;
+	static constexpr unsigned int calibration_residency_factor = 4;
+	std::vector<unsigned int> calibrated_residency_ms;
+	// Measured settle time per (from, to) memory clock
+	std::map<std::pair<int, int>, unsigned long long> calibrated_settle_us;
+
+	// Clock readings before this time may still show the previous lock
+	static constexpr unsigned int default_settle_ms = 500;
+	std::chrono::steady_clock::time_point settle_deadline;
+
+	// Scheduling vars, the adaptive interval stays within min and max
+	static constexpr unsigned int adaptive_margin = 10;
+	unsigned int sampling_period_ms = 1000;
+	unsigned int current_period_ms = 1000;
+	unsigned int min_period_ms = 1000;
+	unsigned int max_period_ms = 1000;
+	std::chrono::steady_clock::time_point next_sample;
+	std::chrono::steady_clock::time_point pending_deadline = std::chrono::steady_clock::time_point::max();
+
+	// GPM vars, samples double buffered per GPU instance and for the whole device
+	struct MigSlice {
+		MigInstanceInfo info;
+		GpmSamplePair gpm;
+	};
+	std::vector<std::unique_ptr<MigSlice>> mig_slices;
+	bool mig_changed = false;
+	std::unique_ptr<GpmSamplePair> device_gpm;
+
+	// Event vars
+	nvmlEventSet_t event_set = nullptr;
+	bool clock_events = false;
+	bool clock_changed = false;
+	std::chrono::steady_clock::time_point event_deadline = std::chrono::steady_clock::time_point::max();
+};
+
+// Construct instances for all devices on a thread pool, one task per device index.
+// Logs are replayed and instances kept in device order, same as serial construction.
+std::vector<std::unique_ptr<PowermizerInstance>> create_instances(unsigned int device_count, const PowermizerConfig &config,
+	const ProfileSet *profiles, const HandoffState *handoff, bool dry_run) {
+	std::vector<std::unique_ptr<PowermizerInstance>> slots(device_count);
+	std::vector<std::vector<LogRecord>> logs(device_count);
+	std::atomic<unsigned int> next_index(0);
+
+	auto worker = [&]() {
+		unsigned int i;
+		while((i = next_index.fetch_add(1)) < device_count) {
+			log_capture = &logs[i];
+			std::unique_ptr<GpuDevice> gpu = dry_run ? std::make_unique<DryRunDevice>() : std::make_unique<NvmlDevice>();
+			slots[i] = std::make_unique<PowermizerInstance>(std::move(gpu), i, config, profiles, handoff);
+			log_capture = NULL;
+		}
+	};
+
+	unsigned int pool_size = std::min(device_count, std::max(std::thread::hardware_concurrency(), 1U));
+	log_printf(LOG_DEBUG, "Initialization threads: %d", pool_size);
+	std::vector<std::thread> pool;
+	for(unsigned int t = 0; t < pool_size; t++) {
+		pool.emplace_back(worker);
+	}
+	for(auto &thread : pool) {
+		thread.join();
+	}
+
+	std::vector<std::unique_ptr<PowermizerInstance>> instances;
+	for(unsigned int i = 0; i < device_count; i++) {
+		log_replay(logs[i]);
+		if(!slots[i]->is_supported()) {
+			log_printf(LOG_WARN, "GPU%d: Not supported", i);
+			continue;
+		}
+		instances.push_back(std::move(slots[i]));
+	}
+	return instances;
+}
+
+// Put GPUs with the same profile group together. With nvlink, GPUs left
+// over are grouped when NVLink connects them, directly or through NVSwitches.
+void form_groups(std::vector<std::unique_ptr<PowermizerInstance>> &instances, bool nvlink) {
+	std::map<std::string, std::vector<PowermizerInstance *>> named;
+	// Union-find over PCI bus IDs, switches included
+	std::map<std::string, std::string> parent;
+	std::function<std::string(const std::string &)> root = [&](const std::string &bus_id) {
+		auto found = parent.find(bus_id);
+		if(found == parent.end() || found->second == bus_id) {
+			return bus_id;
+		}
+		return found->second = root(found->second);
+	};
+
+	for(auto &instance : instances) {
+		if(!instance->get_group_name().empty()) {
+			named[instance->get_group_name()].push_back(instance.get());
+			continue;
+		}
+		if(!nvlink) {
+			continue;
+		}
+		std::vector<std::string> peers;
+		nvmlReturn_t result = instance->get_device()->get_nvlink_peers(peers);
+		if(result != NVML_SUCCESS && result != NVML_ERROR_NOT_SUPPORTED) {
+			log_printf(LOG_WARN, "GPU%d: Failed to get NVLink peers: %s", instance->get_index(), nvmlErrorString(result));
+		}
+		std::string own = root(instance->get_bus_id());
+		parent[own] = own;
+		for(const std::string &peer : peers) {
+			std::string other = root(peer);
+			parent[other] = own;
+		}
+	}
+	if(nvlink) {
+		std::map<std::string, std::vector<PowermizerInstance *>> linked;
+		for(auto &instance : instances) {
+			if(instance->get_group_name().empty() && parent.count(instance->get_bus_id())) {
+				linked[root(instance->get_bus_id())].push_back(instance.get());
+			}
+		}
+		unsigned int count = 0;
+		for(auto &component : linked) {
+			if(component.second.size() > 1) {
+				named["nvlink" + std::to_string(count++)] = component.second;
+			}
+		}
+	}
+
+	for(auto &entry : named) {
+		if(entry.second.size() < 2) {
+			log_printf(LOG_WARN, "GPU%d: Alone in group %s, deciding on its own", entry.second[0]->get_index(), entry.first.c_str());
+			continue;
+		}
+		auto group = std::make_shared<GpuGroup>(entry.first);
+		std::string list;
+		for(auto *member : entry.second) {
+			if(member->get_max_power_state() != entry.second[0]->get_max_power_state()) {
+				log_printf(LOG_WARN, "GPU%d: Power states differ within group %s, following by state index",
+					member->get_index(), entry.first.c_str());
+			}
+			member->join_group(group);
+			list += (list.empty() ? "GPU" : ", GPU") + std::to_string(member->get_index());
+		}
+		log_printf(LOG_INFO, "Group %s: %s", entry.first.c_str(), list.c_str());
+	}
+}
+
+// Start a thread with stop signals blocked, so they are always delivered to the main thread
+template <typename... Args>
+std::thread start_thread(Args&&... args) {
+	sigset_t stop_signals, old_mask;
+	sigemptyset(&stop_signals);
+	sigaddset(&stop_signals, SIGINT);
+	sigaddset(&stop_signals, SIGTERM);
+	sigaddset(&stop_signals, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &stop_signals, &old_mask);
+	std::thread thread(std::forward<Args>(args)...);
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+	return thread;
+}
+
+/* Writes queued log lines from its own thread, flushing once per batch,
+ * so slow terminals or journald back-pressure never stall sampling */
+class AsyncLogger {
+public:
+	~AsyncLogger() {
+		stop();
+	}
+
+	void start() {
+		thread = start_thread(&AsyncLogger::drain_loop, this);
+		log_async = true;
+	}
+
+	// Back to writing in place, after everything queued is out
+	void stop() {
+		if(thread.joinable()) {
+			log_async = false;
+			stopping = true;
+			thread.join();
+			drain();
+		}
+	}
+
+private:
+	void drain_loop() {
+		while(!stopping) {
+			if(!drain()) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(20));
+			}
+		}
+	}
+
+	bool drain() {
+		bool written = false;
+		while(log_ring.pop([](LogLevel level, const char *text) { log_write(level, text); })) {
+			written = true;
+		}
+		unsigned long long dropped = log_dropped.exchange(0, std::memory_order_relaxed);
+		if(dropped > 0) {
+			char message[64];
+			snprintf(message, sizeof(message), "%llu log messages dropped", dropped);
+			log_write(LOG_WARN, message);
+			written = true;
+		}
+		if(written) {
+			fflush(stdout);
+			fflush(stderr);
+		}
+		return written;
+	}
+
+	std::thread thread;
+	std::atomic<bool> stopping{false};
+};
+
+void append_printf(std::string &out, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void append_printf(std::string &out, const char *fmt, ...) {
+	char buffer[512];
+	va_list args;
+	va_start(args, fmt);
+	int len = vsnprintf(buffer, sizeof(buffer), fmt, args);
+	va_end(args);
+	out.append(buffer, std::min(len, (int)sizeof(buffer) - 1));
+}
+
+/* Writes queued trace records to a file from its own thread,
+ * so a slow disk never holds up sampling. Records that do not fit
+ * in a channel are dropped and counted. */
+class TraceRecorder {
+public:
+	~TraceRecorder() {
+		stop();
+	}
+
+	// Append to an existing trace or start a new one
+	bool open(const char *file_path) {
+		file = fopen(file_path, "a+b");
+		if(!file) {
+			log_printf(LOG_ERROR, "Record: Failed to open %s: %s", file_path, strerror(errno));
+			return false;
+		}
+		setvbuf(file, NULL, _IOFBF, 1 << 16);
+
+		TraceFileHeader header = {};
+		memcpy(header.magic, trace_file_magic, sizeof(header.magic));
+		header.version = 1;
+		header.record_size = sizeof(TraceRecord);
+
+		fseek(file, 0, SEEK_END);
+		if(ftell(file) == 0) {
+			fwrite(&header, sizeof(header), 1, file);
+		} else {
+			TraceFileHeader existing;
+			rewind(file);
+			if(fread(&existing, sizeof(existing), 1, file) != 1 || memcmp(&existing, &header, sizeof(header)) != 0) {
+				log_printf(LOG_ERROR, "Record: %s is not a trace of this format", file_path);
+				fclose(file);
+				file = NULL;
+				return false;
+			}
+			fseek(file, 0, SEEK_END);
+		}
+		path = file_path;
+		return true;
+	}
+
+	// Channels are handed out before start()
+	TraceChannel *add_channel() {
+		channels.push_back(std::make_unique<TraceChannel>());
+		return channels.back().get();
+	}
+
+	void start() {
+		log_printf(LOG_INFO, "Record: Writing samples to %s", path.c_str());
+		thread = start_thread(&TraceRecorder::drain_loop, this);
+	}
+
+	void stop() {
+		if(thread.joinable()) {
+			stopping = true;
+			thread.join();
+		}
+		if(file) {
+			drain();
+			unsigned long long dropped = 0;
+			for(auto &channel : channels) {
+				dropped += channel->dropped.load();
+			}
+			if(dropped > 0) {
+				log_printf(LOG_WARN, "Record: %llu records dropped, writer fell behind", dropped);
+			}
+			fclose(file);
+			file = NULL;
+		}
+	}
+
+private:
+	void drain_loop() {
+		while(!stopping) {
+			drain();
+			std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		}
+	}
+
+	void drain() {
+		TraceRecord entry;
+		bool written = false;
+		for(auto &channel : channels) {
+			while(channel->ring.pop(entry)) {
+				if(fwrite(&entry, sizeof(entry), 1, file) != 1 && !write_failed) {
+					log_printf(LOG_ERROR, "Record: Failed to write %s: %s", path.c_str(), strerror(errno));
+					write_failed = true;
+				}
+				written = true;
+			}
+		}
+		if(written) {
+			fflush(file);
+		}
+	}
+
+	FILE *file = NULL;
+	std::string path;
+	std::vector<std::unique_ptr<TraceChannel>> channels;
+	std::thread thread;
+	std::atomic<bool> stopping{false};
+	bool write_failed = false;
+};
+
+/* Prometheus text format endpoint, served from its own thread */
+class MetricsServer {
+public:
+	~MetricsServer() {
+		stop();
+	}
+
+	// Listen on "[host]:port", host defaults to all addresses
+	bool start(const char *listen_spec) {
+		std::string spec(listen_spec);
+		size_t colon = spec.rfind(':');
+		std::string host = colon == std::string::npos ? "" : spec.substr(0, colon);
+		std::string port = colon == std::string::npos ? spec : spec.substr(colon + 1);
+		if(host.size() >= 2 && host.front() == '[' && host.back() == ']') {
+			host = host.substr(1, host.size() - 2);
+		}
+
+		struct addrinfo hints = {};
+		struct addrinfo *addrs;
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags = AI_PASSIVE;
+		int err = getaddrinfo(host.empty() ? NULL : host.c_str(), port.c_str(), &hints, &addrs);
+		if(err != 0) {
+			log_printf(LOG_ERROR, "Metrics: Invalid listen address %s: %s", listen_spec, gai_strerror(err));
+			return false;
+		}
+
+		for(struct addrinfo *addr = addrs; addr && listen_fd < 0; addr = addr->ai_next) {
+			int fd = socket(addr->ai_family, addr->ai_socktype | SOCK_CLOEXEC, addr->ai_protocol);
+			if(fd < 0) {
+				continue;
+			}
+			int one = 1;
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+			if(bind(fd, addr->ai_addr, addr->ai_addrlen) == 0 && listen(fd, 16) == 0) {
+				listen_fd = fd;
+			} else {
+				close(fd);
+			}
+		}
+		freeaddrinfo(addrs);
+
+		if(listen_fd < 0) {
+			log_printf(LOG_ERROR, "Metrics: Failed to listen on %s: %s", listen_spec, strerror(errno));
+			return false;
+		}
+		log_printf(LOG_INFO, "Metrics: Listening on %s", listen_spec);
+		thread = start_thread(&MetricsServer::serve, this);
+		return true;
+	}
+
+	void stop() {
+		if(thread.joinable()) {
+			stopping = true;
+			thread.join();
+		}
+		if(listen_fd >= 0) {
+			close(listen_fd);
+			listen_fd = -1;
+		}
+	}
+
+	void add(std::shared_ptr<InstanceMetrics> source) {
+		std::lock_guard<std::mutex> lock(mutex);
+		sources.push_back(source);
+	}
+
+private:
+	void serve() {
+		while(!stopping) {
+			struct pollfd pfd = {listen_fd, POLLIN, 0};
+			if(poll(&pfd, 1, 200) <= 0) {
+				continue;
+			}
+			int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+			if(fd < 0) {
+				continue;
+			}
+			handle(fd);
+			close(fd);
+		}
+	}
+
+	void handle(int fd) {
+		// Only the request line matters, any path returns the metrics
+		char request[1024];
+		struct timeval timeout = {1, 0};
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		if(recv(fd, request, sizeof(request), 0) <= 0) {
+			return;
+		}
+
+		std::string body = render();
+		std::string response;
+		append_printf(response, "HTTP/1.0 200 OK\r\n"
+			"Content-Type: text/plain; version=0.0.4\r\n"
+			"Content-Length: %zu\r\n"
+			"Connection: close\r\n\r\n", body.size());
+		response += body;
+
+		size_t sent = 0;
+		while(sent < response.size()) {
+			ssize_t n = send(fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+			if(n <= 0) {
+				return;
+			}
+			sent += n;
+		}
+	}
+
+	static void render_histogram(std::string &out, const char *name, const char *labels, const LatencyHistogram &histogram) {
+		unsigned long long cumulative = 0;
+		for(unsigned int i = 0; i <= LatencyHistogram::bucket_count; i++) {
+			cumulative += histogram.buckets[i].load(std::memory_order_relaxed);
+			if(i < LatencyHistogram::bucket_count) {
+				append_printf(out, "%s_bucket{%s,le=\"%g\"} %llu\n", name, labels, histogram.bounds[i] / 1e6, cumulative);
+			} else {
+				append_printf(out, "%s_bucket{%s,le=\"+Inf\"} %llu\n", name, labels, cumulative);
+			}
+		}
+		append_printf(out, "%s_sum{%s} %g\n", name, labels, histogram.sum_us.load(std::memory_order_relaxed) / 1e6);
+		append_printf(out, "%s_count{%s} %llu\n", name, labels, cumulative);
+	}
+
+	std::string render() {
+		std::lock_guard<std::mutex> lock(mutex);
+		std::string out;
+		char labels[128];
+
+		out += "# HELP nvidia_powermizer_utilization_percent Utilization driving the last decision\n";
+		out += "# TYPE nvidia_powermizer_utilization_percent gauge\n";
+		for(auto &m : sources) {
+			append_printf(out, "nvidia_powermizer_utilization_percent{gpu=\"%d\"} %u\n", m->index, m->max_utilization.load());
+		}
+		out += "# HELP nvidia_powermizer_power_state Current power state, 0 is the highest clock\n";
+		out += "# TYPE nvidia_powermizer_power_state gauge\n";
+		for(auto &m : sources) {
+			append_printf(out, "nvidia_powermizer_power_state{gpu=\"%d\"} %d\n", m->index, m->power_state.load());
+		}
+		out += "# HELP nvidia_powermizer_memory_clock_mhz Locked memory clock\n";
+		out += "# TYPE nvidia_powermizer_memory_clock_mhz gauge\n";
+		for(auto &m : sources) {
+			append_printf(out, "nvidia_powermizer_memory_clock_mhz{gpu=\"%d\"} %d\n", m->index, m->memory_clock.load());
+		}
+		out += "# HELP nvidia_powermizer_power_watts Board power draw at the last sample\n";
+		out += "# TYPE nvidia_powermizer_power_watts gauge\n";
+		for(auto &m : sources) {
+			if(m->power_sampled.load()) {
+				append_printf(out, "nvidia_powermizer_power_watts{gpu=\"%d\"} %g\n", m->index, m->power_mw.load() / 1e3);
+			}
+		}
+		out += "# HELP nvidia_powermizer_energy_joules_total Energy used since the driver loaded\n";
+		out += "# TYPE nvidia_powermizer_energy_joules_total counter\n";
+		for(auto &m : sources) {
+			if(m->energy_sampled.load()) {
+				append_printf(out, "nvidia_powermizer_energy_joules_total{gpu=\"%d\"} %g\n", m->index, m->energy_mj.load() / 1e3);
+			}
+		}
+		out += "# HELP nvidia_powermizer_nvml_calls_total NVML calls made while processing\n";
+		out += "# TYPE nvidia_powermizer_nvml_calls_total counter\n";
+		for(auto &m : sources) {
+			append_printf(out, "nvidia_powermizer_nvml_calls_total{gpu=\"%d\"} %llu\n", m->index, m->nvml_calls.load());
+		}
+		out += "# HELP nvidia_powermizer_nvml_calls_saved_total NVML calls avoided by sharing readings\n";
+		out += "# TYPE nvidia_powermizer_nvml_calls_saved_total counter\n";
+		for(auto &m : sources) {
+			append_printf(out, "nvidia_powermizer_nvml_calls_saved_total{gpu=\"%d\"} %llu\n", m->index, m->nvml_calls_saved.load());
+		}
+		out += "# HELP nvidia_powermizer_gpu_lost Whether the GPU is lost and waiting to reattach\n";
+		out += "# TYPE nvidia_powermizer_gpu_lost gauge\n";
+		for(auto &m : sources) {
+			append_printf(out, "nvidia_powermizer_gpu_lost{gpu=\"%d\"} %d\n", m->index, m->lost.load() ? 1 : 0);
+		}
+		out += "# HELP nvidia_powermizer_gpu_degraded Whether NVML calls on the GPU stall past the watchdog time\n";
+		out += "# TYPE nvidia_powermizer_gpu_degraded gauge\n";
+		for(auto &m : sources) {
+			append_printf(out, "nvidia_powermizer_gpu_degraded{gpu=\"%d\"} %d\n", m->index, m->degraded.load() ? 1 : 0);
+		}
+		out += "# HELP nvidia_powermizer_transitions_total Power state transitions\n";
+		out += "# TYPE nvidia_powermizer_transitions_total counter\n";
+		for(auto &m : sources) {
+			for(int d = 0; d < TRANSITION_COUNT; d++) {
+				append_printf(out, "nvidia_powermizer_transitions_total{gpu=\"%d\",direction=\"%s\"} %llu\n",
+					m->index, transition_names[d], m->transitions[d].load());
+			}
+		}
+		out += "# HELP nvidia_powermizer_state_seconds_total Time spent in each power state\n";
+		out += "# TYPE nvidia_powermizer_state_seconds_total counter\n";
+		for(auto &m : sources) {
+			for(unsigned int s = 0; s < m->state_count; s++) {
+				append_printf(out, "nvidia_powermizer_state_seconds_total{gpu=\"%d\",state=\"%u\"} %g\n",
+					m->index, s, m->state_time_us[s].load() / 1e6);
+			}
+		}
+		out += "# HELP nvidia_powermizer_underclocked_busy_seconds_total Time busy below the highest power state\n";
+		out += "# TYPE nvidia_powermizer_underclocked_busy_seconds_total counter\n";
+		for(auto &m : sources) {
+			append_printf(out, "nvidia_powermizer_underclocked_busy_seconds_total{gpu=\"%d\"} %g\n",
+				m->index, m->underclocked_busy_us.load() / 1e6);
+		}
+		out += "# HELP nvidia_powermizer_sampling_interval_seconds Current interval between samples\n";
+		out += "# TYPE nvidia_powermizer_sampling_interval_seconds gauge\n";
+		for(auto &m : sources) {
+			append_printf(out, "nvidia_powermizer_sampling_interval_seconds{gpu=\"%d\"} %g\n",
+				m->index, m->sampling_period_ms.load() / 1e3);
+		}
+		out += "# HELP nvidia_powermizer_transition_delay_seconds Delay from threshold crossing to clock change\n";
+		out += "# TYPE nvidia_powermizer_transition_delay_seconds histogram\n";
+		for(auto &m : sources) {
+			for(int d = 0; d < TRANSITION_COUNT; d++) {
+				snprintf(labels, sizeof(labels), "gpu=\"%d\",direction=\"%s\"", m->index, transition_names[d]);
+				render_histogram(out, "nvidia_powermizer_transition_delay_seconds", labels, *m->transition_delay[d]);
+			}
+		}
+		out += "# HELP nvidia_powermizer_nvml_call_seconds Latency of NVML calls made while processing\n";
+		out += "# TYPE nvidia_powermizer_nvml_call_seconds histogram\n";
+		for(auto &m : sources) {
+			for(int c = 0; c < NVML_CALL_COUNT; c++) {
+				snprintf(labels, sizeof(labels), "gpu=\"%d\",call=\"%s\"", m->index, nvml_call_names[c]);
+				render_histogram(out, "nvidia_powermizer_nvml_call_seconds", labels, *m->nvml_latency[c]);
+			}
+		}
+		return out;
+	}
+
+	int listen_fd = -1;
+	std::thread thread;
+	std::atomic<bool> stopping{false};
+	std::mutex mutex;
+	std::vector<std::shared_ptr<InstanceMetrics>> sources;
+};
+
+/* Unix domain socket accepting runtime commands, one per line:
+ *   boost <gpu> <seconds>       Hold the highest power state
+ *   pin <gpu> <state>           Hold a power state until unpinned
+ *   unpin <gpu>                 Return to the policy
+ *   set <gpu> <setting> <value> Change a setting, named after its long option
+ *   status                      One line per GPU
+ * <gpu> is an index, GPU<index> or all. Each command is answered with OK,
+ * ERROR <reason> or the status lines followed by OK. */
+class ControlServer {
+public:
+	~ControlServer() {
+		stop();
+	}
+
+	bool start(const char *socket_path, std::vector<std::unique_ptr<PowermizerInstance>> &targets) {
+		struct sockaddr_un addr = {};
+		if(strlen(socket_path) >= sizeof(addr.sun_path)) {
+			log_printf(LOG_ERROR, "Control: Socket path too long: %s", socket_path);
+			return false;
+		}
+		addr.sun_family = AF_UNIX;
+		strcpy(addr.sun_path, socket_path);
+
+		listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if(listen_fd < 0) {
+			log_printf(LOG_ERROR, "Control: Failed to create socket: %s", strerror(errno));
+			return false;
+		}
+		// A stale socket from a previous run would make bind fail
+		unlink(socket_path);
+		mode_t old_umask = umask(0117);
+		int err = bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr));
+		umask(old_umask);
+		if(err != 0 || listen(listen_fd, 8) != 0) {
+			log_printf(LOG_ERROR, "Control: Failed to listen on %s: %s", socket_path, strerror(errno));
+			close(listen_fd);
+			listen_fd = -1;
+			return false;
+		}
+
+		path = socket_path;
+		for(auto &instance : targets) {
+			instances.push_back(instance.get());
+		}
+		log_printf(LOG_INFO, "Control: Listening on %s", socket_path);
+		thread = start_thread(&ControlServer::serve, this);
+		return true;
+	}
+
+	void stop() {
+		if(thread.joinable()) {
+			stopping = true;
+			thread.join();
+		}
+		if(listen_fd >= 0) {
+			close(listen_fd);
+			unlink(path.c_str());
+			listen_fd = -1;
+		}
+	}
+
+private:
+	void serve() {
+		while(!stopping) {
+			struct pollfd pfd = {listen_fd, POLLIN, 0};
+			if(poll(&pfd, 1, 200) <= 0) {
+				continue;
+			}
+			int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+			if(fd < 0) {
+				continue;
+			}
+			handle(fd);
+			close(fd);
+		}
+	}
+
+	// Serve commands until the client closes or goes quiet
+	void handle(int fd) {
+		struct timeval timeout = {5, 0};
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+		std::string pending;
+		char buffer[512];
+		ssize_t n;
+		while(!stopping && (n = recv(fd, buffer, sizeof(buffer), 0)) > 0) {
+			pending.append(buffer, n);
+			size_t newline;
+			while((newline = pending.find('\n')) != std::string::npos) {
+				std::string reply = execute(pending.substr(0, newline));
+				pending.erase(0, newline + 1);
+				if(send(fd, reply.data(), reply.size(), MSG_NOSIGNAL) < 0) {
+					return;
+				}
+			}
+			if(pending.size() > 4096) {
+				return;
+			}
+		}
+	}
+
+	// Instances addressed by a target, empty when none match
+	std::vector<PowermizerInstance *> select(const char *target) {
+		std::vector<PowermizerInstance *> selected;
+		unsigned int gpu;
+		bool all = strcmp(target, "all") == 0;
+
+		if(strncasecmp(target, "GPU", 3) == 0) {
+			target += 3;
+		}
+		if(!all && !parse_uint(target, &gpu)) {
+			return selected;
+		}
+		for(auto *instance : instances) {
+			if(all || instance->get_index() == (int)gpu) {
+				selected.push_back(instance);
+			}
+		}
+		return selected;
+	}
+
+	std::string execute(const std::string &line) {
+		char command[32] = "", target[32] = "", arg1[64] = "", arg2[64] = "";
+		int args = sscanf(line.c_str(), "%31s %31s %63s %63s", command, target, arg1, arg2);
+		if(args <= 0) {
+			return "ERROR empty command\n";
+		}
+
+		if(strcmp(command, "status") == 0) {
+			std::string reply;
+			for(auto *instance : instances) {
+				auto m = instance->get_metrics();
+				auto group = instance->get_group();
+				append_printf(reply, "GPU%d state %d clock %d utilization %u%s%s%s%s\n", instance->get_index(),
+					m->power_state.load(), m->memory_clock.load(), m->max_utilization.load(), m->lost.load() ? " lost" : "",
+					m->degraded.load() ? " degraded" : "", group ? " group " : "", group ? group->name.c_str() : "");
+			}
+			return reply + "OK\n";
+		}
+
+		if(args < 2) {
+			return "ERROR missing GPU\n";
+		}
+		auto selected = select(target);
+		if(selected.empty()) {
+			return "ERROR unknown GPU\n";
+		}
+
+		unsigned int value;
+		if(strcmp(command, "boost") == 0 && args == 3 && parse_uint(arg1, &value)) {
+			auto until = std::chrono::steady_clock::now() + std::chrono::seconds(value);
+			for(auto *instance : selected) {
+				instance->boost_hint(until);
+			}
+		} else if(strcmp(command, "pin") == 0 && args == 3 && parse_uint(arg1, &value)) {
+			for(auto *instance : selected) {
+				if(value >= instance->get_metrics()->state_count) {
+					return "ERROR invalid power state\n";
+				}
+			}
+			for(auto *instance : selected) {
+				instance->pin_power_state(value);
+			}
+		} else if(strcmp(command, "unpin") == 0 && args == 2) {
+			for(auto *instance : selected) {
+				instance->pin_power_state(-1);
+			}
+		} else if(strcmp(command, "set") == 0 && args == 4) {
+			// All selected GPUs take the setting or none does
+			std::vector<std::unique_lock<std::mutex>> locks;
+			std::vector<PowermizerConfig> staged(selected.size());
+			for(size_t i = 0; i < selected.size(); i++) {
+				locks.push_back(selected[i]->lock_config());
+				bool ok = selected[i]->stage_config([&](PowermizerConfig &config) {
+					return apply_config_setting(config, arg1, arg2);
+				}, staged[i]);
+				if(!ok) {
+					return "ERROR invalid setting\n";
+				}
+			}
+			for(size_t i = 0; i < selected.size(); i++) {
+				selected[i]->commit_config(staged[i]);
+			}
+		} else {
+			return "ERROR invalid command\n";
+		}
+
+		log_printf(LOG_INFO, "Control: %s", line.c_str());
+		return "OK\n";
+	}
+
+	int listen_fd = -1;
+	std::string path;
+	std::thread thread;
+	std::atomic<bool> stopping{false};
+	std::vector<PowermizerInstance *> instances;
+};
+
+/* Node governor above the per-GPU policies. Keeps the summed board power
+ * under a budget by capping how far each GPU may boost, granting the
+ * busiest GPUs first, and lowers GPUs early as they approach their
+ * slowdown temperature so hardware throttling never engages. */
+class Governor {
+public:
+	// Temperatures and power move on a scale of seconds
+	static constexpr unsigned int period_ms = 500;
+
+	// With shared_power the instances read power for others anyway, so taking their readings saves calls
+	Governor(std::vector<std::unique_ptr<PowermizerInstance>> &instances, unsigned int power_budget_w, unsigned int temp_margin_c,
+		bool shared_power) :
+		budget_mw(power_budget_w * 1000ULL), temp_margin(temp_margin_c), power_shared(shared_power) {
+		for(auto &instance : instances) {
+			GovernedGpu gpu;
+			gpu.instance = instance.get();
+			gpu.metrics = instance->get_metrics();
+			gpu.peak_mw.assign(gpu.metrics->state_count, 0);
+
+			// Built before the instances run, the only time the governor reads their devices
+			GpuDevice *device = instance->get_device();
+			if(device->get_enforced_power_limit(&gpu.power_limit_mw) != NVML_SUCCESS) {
+				gpu.power_limit_mw = 0;
+			}
+			if(temp_margin > 0) {
+				nvmlReturn_t result = device->get_slowdown_temperature(&gpu.slowdown_temp);
+				if(result != NVML_SUCCESS) {
+					log_printf(LOG_WARN, "GPU%d: Slowdown temperature not available, no thermal limit: %s",
+						instance->get_index(), nvmlErrorString(result));
+					gpu.slowdown_temp = 0;
+				} else {
+					log_printf(LOG_DEBUG, "GPU%d: Slowdown temperature: %d C", instance->get_index(), gpu.slowdown_temp);
+					instance->set_temperature_sampling(period_ms);
+				}
+			}
+			gpus.push_back(std::move(gpu));
+		}
+	}
+
+	~Governor() {
+		stop();
+	}
+
+	void start() {
+		if(budget_mw > 0) {
+			log_printf(LOG_INFO, "Governor: Power budget %llu W", budget_mw / 1000);
+		}
+		if(temp_margin > 0) {
+			log_printf(LOG_INFO, "Governor: Lowering clocks within %d C of slowdown", temp_margin);
+		}
+		thread = start_thread(&Governor::run, this);
+	}
+
+	void stop() {
+		if(thread.joinable()) {
+			stopping = true;
+			thread.join();
+		}
+	}
+
+private:
+	struct GovernedGpu {
+		PowermizerInstance *instance;
+		std::shared_ptr<InstanceMetrics> metrics;
+		unsigned int power_limit_mw = 0;
+		unsigned int slowdown_temp = 0;
+		// Highest draw seen per state, decaying so estimates follow the load
+		std::vector<unsigned int> peak_mw;
+		unsigned int power_mw = 0;
+		int state = 0;
+		int thermal_cap = 0;
+		int cap = 0;
+		bool hot = false;
+	};
+
+	static constexpr unsigned int thermal_hysteresis_c = 3;
+
+	void run() {
+		auto next = std::chrono::steady_clock::now();
+		while(!stopping) {
+			update();
+			next += std::chrono::milliseconds(period_ms);
+			std::this_thread::sleep_until(next);
+		}
+	}
+
+	void update() {
+		for(GovernedGpu &gpu : gpus) {
+			gpu.state = gpu.metrics->power_state.load(std::memory_order_relaxed);
+			if(budget_mw > 0) {
+				read_power(gpu);
+			}
+			if(gpu.slowdown_temp > 0) {
+				check_temperature(gpu);
+			}
+		}
+		if(budget_mw > 0) {
+			allocate_budget();
+		}
+		for(GovernedGpu &gpu : gpus) {
+			int cap = budget_mw > 0 ? gpu.cap : gpu.thermal_cap;
+			if(cap != gpu.instance->get_state_cap()) {
+				log_printf(LOG_DEBUG, "GPU%d: Governor allows state %d", gpu.instance->get_index(), cap);
+				gpu.instance->set_state_cap(cap);
+			}
+		}
+	}
+
+	void read_power(GovernedGpu &gpu) {
+		// A lost GPU draws nothing worth budgeting for
+		if(gpu.instance->is_lost()) {
+			gpu.power_mw = 0;
+			return;
+		}
+		// Readings of a stalled GPU are stale, budget for the worst
+		if(gpu.metrics->degraded.load(std::memory_order_relaxed)) {
+			gpu.power_mw = gpu.power_limit_mw;
+			return;
+		}
+		// Only the instance's published readings, its device may be reopened under it.
+		// Until the first one or once power is not available, assume the limit
+		if(!gpu.metrics->power_sampled.load(std::memory_order_relaxed)) {
+			gpu.power_mw = gpu.power_limit_mw;
+			return;
+		}
+		gpu.power_mw = gpu.metrics->power_mw.load(std::memory_order_relaxed);
+		if(power_shared) {
+			gpu.metrics->nvml_calls_saved.fetch_add(1, std::memory_order_relaxed);
+		}
+		update_peak(gpu);
+	}
+
+	void update_peak(GovernedGpu &gpu) {
+		unsigned int &peak = gpu.peak_mw[gpu.state];
+		peak = std::max(gpu.power_mw, peak - peak / 64);
+	}
+
+	// Step one state lower per period while too hot, back up once cooled down
+	void check_temperature(GovernedGpu &gpu) {
+		int index = gpu.instance->get_index();
+		if(gpu.instance->is_lost() || gpu.metrics->degraded.load(std::memory_order_relaxed) ||
+			!gpu.metrics->temperature_sampled.load(std::memory_order_relaxed)) {
+			return;
+		}
+		unsigned int temperature = gpu.metrics->temperature_c.load(std::memory_order_relaxed);
+		if(temperature + temp_margin >= gpu.slowdown_temp) {
+			gpu.thermal_cap = std::min(std::max(gpu.thermal_cap, gpu.state + 1), (int)gpu.metrics->state_count - 1);
+			if(!gpu.hot) {
+				log_printf(LOG_INFO, "GPU%d: %d C, near slowdown at %d C, lowering clocks", index, temperature, gpu.slowdown_temp);
+				gpu.hot = true;
+			}
+		} else if(temperature + temp_margin + thermal_hysteresis_c <= gpu.slowdown_temp && gpu.thermal_cap > 0) {
+			gpu.thermal_cap--;
+			if(gpu.thermal_cap == 0 && gpu.hot) {
+				log_printf(LOG_INFO, "GPU%d: %d C, thermal limit lifted", index, temperature);
+				gpu.hot = false;
+			}
+		}
+	}
+
+	// Expected draw of a GPU held to a state
+	unsigned int estimate_mw(const GovernedGpu &gpu, int state) {
+		if(gpu.peak_mw[state] > 0) {
+			return gpu.peak_mw[state];
+		}
+		// Unseen states draw no more than now when lower, up to the limit when higher
+		if(state >= gpu.state) {
+			return gpu.power_mw;
+		}
+		return std::max(gpu.power_limit_mw, gpu.power_mw);
+	}
+
+	// Every GPU may always sit in its lowest state, the rest of the budget
+	// goes to the busiest GPUs first, each taking the highest state that fits
+	void allocate_budget() {
+		std::vector<GovernedGpu *> order;
+		long long remaining_mw = budget_mw;
+		bool lowest_known = true;
+		for(GovernedGpu &gpu : gpus) {
+			order.push_back(&gpu);
+			remaining_mw -= estimate_mw(gpu, gpu.metrics->state_count - 1);
+			lowest_known = lowest_known && gpu.peak_mw.back() > 0;
+		}
+		// Only trust the verdict once every GPU has been measured at its lowest state
+		if(remaining_mw < 0 && lowest_known && !over_budget) {
+			log_printf(LOG_WARN, "Governor: Power budget is below the draw at the lowest clocks");
+		}
+		over_budget = remaining_mw < 0 && lowest_known;
+
+		std::stable_sort(order.begin(), order.end(), [](const GovernedGpu *a, const GovernedGpu *b) {
+			return a->metrics->max_utilization.load(std::memory_order_relaxed) >
+				b->metrics->max_utilization.load(std::memory_order_relaxed);
+		});
+		for(GovernedGpu *gpu : order) {
+			int lowest = gpu->metrics->state_count - 1;
+			unsigned int base_mw = estimate_mw(*gpu, lowest);
+			gpu->cap = lowest;
+			for(int state = gpu->thermal_cap; state < lowest; state++) {
+				long long extra_mw = (long long)estimate_mw(*gpu, state) - base_mw;
+				if(extra_mw <= remaining_mw) {
+					gpu->cap = state;
+					break;
+				}
+			}
+			remaining_mw -= (long long)estimate_mw(*gpu, gpu->cap) - base_mw;
+		}
+	}
+
+	unsigned long long budget_mw;
+	unsigned int temp_margin;
+	bool power_shared;
+	std::vector<GovernedGpu> gpus;
+	bool over_budget = false;
+	std::thread thread;
+	std::atomic<bool> stopping{false};
+};
+
+/* Replay */
+// Memory clocks of the simulated GPU unless given with -C
+static const std::vector<unsigned int> replay_default_mem_clocks = {9501, 5001, 810, 405};
+
+// Built-in load patterns for comparing settings, utilization by time in seconds
+struct SyntheticTrace {
+	const char *name;
+	unsigned int (*utilization)(double t);
+};
+
+static const SyntheticTrace synthetic_traces[] = {
+	{"idle",   [](double) { return 3U; }},
+	{"steady", [](double) { return 70U; }},
+	{"bursty", [](double t) { return fmod(t, 10.0) < 2.0 ? 95U : 5U; }},
+	{"ramp",   [](double t) { double phase = fmod(t, 120.0) / 60.0; return (unsigned int)(100.0 * (phase < 1.0 ? phase : 2.0 - phase)); }},
+	{"spikes", [](double t) { return fmod(t, 3.0) < 0.3 ? 100U : 2U; }},
+	{"noisy",  [](double t) { return (unsigned int)(50.0 + 15.0 * sin(t * 1.7) + 10.0 * sin(t * 7.3)); }},
+};
+
+// Ten minutes of a synthetic pattern at 100 ms, memory following at 60%
+bool synthetic_trace(const char *name, std::vector<TraceSample> &trace) {
+	for(const SyntheticTrace &synthetic : synthetic_traces) {
+		if(strcmp(synthetic.name, name) == 0) {
+			for(long long t = 0; t <= 600000000LL; t += 100000) {
+				unsigned int utilization = synthetic.utilization(t / 1e6);
+				trace.push_back({t, utilization, utilization * 6 / 10, 0, 0});
+			}
+			return true;
+		}
+	}
+	return false;
+}
+
+// Read a CSV trace, one sample per line: time_ms,gpu,gpu_util[,mem_util[,enc_util[,dec_util]]]
+// Lines starting with # and a header line are skipped
+bool load_csv_trace(FILE *file, const char *path, std::map<unsigned int, std::vector<TraceSample>> &traces) {
+	char line[256];
+	unsigned int line_number = 0;
+	while(fgets(line, sizeof(line), file)) {
+		line_number++;
+		if(line[0] == '#' || line[0] == '\n' || line[0] == '\r') {
+			continue;
+		}
+		double time_ms;
+		unsigned int gpu;
+		TraceSample sample = {};
+		int fields = sscanf(line, "%lf,%u,%u,%u,%u,%u", &time_ms, &gpu,
+			&sample.gpu, &sample.memory, &sample.encoder, &sample.decoder);
+		if(fields < 3) {
+			if(line_number == 1) {
+				continue;
+			}
+			log_printf(LOG_ERROR, "Replay: %s:%d: Malformed sample", path, line_number);
+			return false;
+		}
+		sample.time_us = llround(time_ms * 1000.0);
+		traces[gpu].push_back(sample);
+	}
+	return true;
+}
+
+// Read the samples of a trace written by --record
+bool load_recorded_trace(FILE *file, const char *path, std::map<unsigned int, std::vector<TraceSample>> &traces) {
+	TraceFileHeader header;
+	if(fread(&header, sizeof(header), 1, file) != 1 || header.version != 1 || header.record_size != sizeof(TraceRecord)) {
+		log_printf(LOG_ERROR, "Replay: %s: Unsupported trace version", path);
+		return false;
+	}
+
+	TraceRecord entry;
+	while(fread(&entry, sizeof(entry), 1, file) == 1) {
+		traces[entry.gpu_index].push_back({(long long)entry.time_us, entry.gpu, entry.memory, entry.encoder, entry.decoder});
+	}
+	return true;
+}
+
+// Read a trace recorded with --record or a CSV trace, times start at 0 per GPU afterwards
+bool load_trace(const char *path, std::map<unsigned int, std::vector<TraceSample>> &traces) {
+	FILE *file = fopen(path, "rb");
+	if(!file) {
+		log_printf(LOG_ERROR, "Replay: Failed to open %s: %s", path, strerror(errno));
+		return false;
+	}
+
+	char magic[sizeof(trace_file_magic)];
+	bool recorded = fread(magic, sizeof(magic), 1, file) == 1 && memcmp(magic, trace_file_magic, sizeof(magic)) == 0;
+	rewind(file);
+	bool loaded = recorded ? load_recorded_trace(file, path, traces) : load_csv_trace(file, path, traces);
+	fclose(file);
+	if(!loaded) {
+		return false;
+	}
+
+	for(auto &entry : traces) {
+		auto &trace = entry.second;
+		std::stable_sort(trace.begin(), trace.end(), [](const TraceSample &a, const TraceSample &b) {
+			return a.time_us < b.time_us;
+		});
+		long long start_us = trace[0].time_us;
+		for(TraceSample &sample : trace) {
+			sample.time_us -= start_us;
+		}
+	}
+	return true;
+}
+
+// Feed traces through the policy on a simulated GPU each, and report how it did
+int run_replay(const char *source, const PowermizerConfig &config, unsigned int interval_ms,
+	unsigned int min_interval_ms, unsigned int max_interval_ms, const ProfileSet *profiles) {
+	std::map<unsigned int, std::vector<TraceSample>> traces;
+	if(strncmp(source, "synthetic:", 10) == 0) {
+		if(!synthetic_trace(source + 10, traces[0])) {
+			log_printf(LOG_ERROR, "Replay: Unknown synthetic trace: %s", source + 10);
+			return 1;
+		}
+	} else if(!load_trace(source, traces)) {
+		return 1;
+	}
+
+	const std::vector<unsigned int> &mem_clocks = config.mem_clocks.empty() ? replay_default_mem_clocks : config.mem_clocks;
+	for(auto &entry : traces) {
+		int index = entry.first;
+		if(entry.second.size() < 2) {
+			log_printf(LOG_WARN, "GPU%d: Trace too short, skipped", index);
+			continue;
+		}
+
+		auto replay = std::make_unique<ReplayDevice>(std::move(entry.second), mem_clocks, config);
+		ReplayDevice *simulated = replay.get();
+		PowermizerInstance instance(std::move(replay), index, config, profiles);
+		if(!instance.is_supported()) {
+			return 1;
+		}
+
+		// Jump from deadline to deadline as the run loop would sleep
+		instance.set_sampling_period(interval_ms);
+		instance.set_sampling_range(min_interval_ms, max_interval_ms);
+		auto end = simulated->now() + std::chrono::microseconds(simulated->duration_us());
+		while(instance.next_deadline() <= end) {
+			simulated->advance_to(instance.next_deadline());
+			instance.process();
+		}
+		simulated->advance_to(end);
+
+		auto metrics = instance.get_metrics();
+		double duration_s = simulated->duration_us() / 1e6;
+		unsigned long long boosts = metrics->transitions[TRANSITION_BOOST].load();
+		unsigned long long lowers = metrics->transitions[TRANSITION_LOWER].load();
+		printf("GPU%d: Replayed %.1f s, %llu transitions (%llu boost, %llu lower), %llu ticks\n",
+			index, duration_s, boosts + lowers, boosts, lowers, metrics->ticks.load());
+		for(unsigned int state = 0; state < metrics->state_count; state++) {
+			double state_s = metrics->state_time_us[state].load() / 1e6;
+			printf("GPU%d: State %d (%d MHz): %.1f s (%.1f%%)\n",
+				index, state, instance.get_clock(state), state_s, 100.0 * state_s / duration_s);
+		}
+		printf("GPU%d: Estimated energy: %.0f J\n", index, simulated->get_energy_j());
+		printf("GPU%d: Under-clocked while busy: %lld ms\n", index, simulated->get_underclocked_busy_us() / 1000);
+	}
+	return 0;
+}
+
+// Report what a dry run would have done, from the instance's own bookkeeping
+void report_dry_run(PowermizerInstance &instance, double duration_s) {
+	auto metrics = instance.get_metrics();
+	int index = instance.get_index();
+	unsigned long long boosts = metrics->transitions[TRANSITION_BOOST].load();
+	unsigned long long lowers = metrics->transitions[TRANSITION_LOWER].load();
+	log_printf(LOG_INFO, "GPU%d: Dry run over %.1f s, would have made %llu transitions (%llu boost, %llu lower)",
+		index, duration_s, boosts + lowers, boosts, lowers);
+	for(unsigned int state = 0; state < metrics->state_count; state++) {
+		double state_s = metrics->state_time_us[state].load() / 1e6;
+		log_printf(LOG_INFO, "GPU%d: State %d (%d MHz): %.1f s (%.1f%%)",
+			index, state, instance.get_clock(state), state_s, duration_s > 0 ? 100.0 * state_s / duration_s : 0.0);
+	}
+	log_printf(LOG_INFO, "GPU%d: Would have been under-clocked while busy: %llu ms", index, metrics->underclocked_busy_us.load() / 1000);
+}
+
+void print_usage(const char *progname) {
+	printf("Usage: %s [options]\n", progname);
+	printf("Options:\n");
+	printf("  -h, --help                   Print this help message\n");
+	printf("  -b, --boost <util>           Set the utilization threshold to boost power state\n");
+	printf("  -l, --low-power <util>       Set the utilization threshold to lower power state\n");
+	printf("  -B, --boost-time <ms>        Set the time to boost power state\n");
+	printf("  -L, --low-power-time <ms>    Set the time to lower power state\n");
+	printf("  -m, --mem-boost <util>       Set the memory utilization threshold to boost power state\n");
+	printf("  -M, --mem-low-power <util>   Set the memory utilization threshold to lower power state\n");
+	printf("  -C, --mem-clocks <list>      Use only these memory clocks as power states (e.g. 2619,1593,810)\n");
+	printf("  -g, --gpu-clocks             Lock graphics clocks along with memory clocks\n");
+	printf("      --gpu-boost-clock <MHz>  Set the lowest graphics clock in the highest power state (default: highest)\n");
+	printf("      --gpu-low-power-clock <MHz>\n");
+	printf("                               Set the highest graphics clock in the lowest power state (default: lowest)\n");
+	printf("      --policy <name>          Control policy: hysteresis (default), ewma or pid\n");
+	printf("      --target <util>          Utilization the pid policy aims at (default: halfway between -b and -l)\n");
+	printf("      --smoothing <ms>         Time constant of the ewma policy (default: 1000)\n");
+	printf("      --pid <kp,ki,kd>         Gains of the pid policy in states per unit error (default: 4,0.5,0)\n");
+	printf("  -p, --boost-policy <policy>  Set the boost policy: step, jump or proportional (default: step)\n");
+	printf("  -s, --samples <stat>         Decide on utilization history: mean, max or p<N> (e.g. p90)\n");
+	printf("      --gpm                    Decide on GPM DRAM bandwidth instead of utilization counters\n");
+	printf("      --mig <max|weighted>     Aggregate MIG instance activity by the busiest or SM-weighted (default: max)\n");
+	printf("  -i, --interval <ms>          Set the sampling interval (default: 100)\n");
+	printf("      --min-interval <ms>      Sample down to this interval near a threshold (default: -i)\n");
+	printf("      --max-interval <ms>      Back off up to this interval while steady (default: -i)\n");
+	printf("      --predict <ms>           Boost at once when a new compute process starts, hold for this grace time\n");
+	printf("      --learn <file>           Start recurring workloads at the power state they settled at before\n");
+	printf("      --learn-key <name|cgroup>\n");
+	printf("                               Tell workloads apart by process name or control group (default: name)\n");
+	printf("      --control <path>         Accept runtime commands on a Unix domain socket\n");
+	printf("      --power-budget <W>       Keep the summed board power of all GPUs under this budget\n");
+	printf("      --temp-margin <C>        Lower clocks when a GPU gets this close to its slowdown temperature\n");
+	printf("      --config <file>          Per-GPU profiles, reloaded on SIGHUP\n");
+	printf("      --record <file>          Append per-sample records to a binary trace file\n");
+	printf("      --replay <trace>         Run the policy over a CSV trace or synthetic:<name> and report, no GPU needed\n");
+	printf("      --dry-run                Run the policy on the GPUs without changing clocks and report on exit\n");
+	printf("      --handoff <file>         On SIGTERM leave clocks locked and hand the state to the next run\n");
+	printf("      --calibrate <file>       Time every memory clock transition, save them per GPU model and exit\n");
+	printf("      --calibration <file>     Hold states before lowering as long as their measured transitions require\n");
+	printf("      --bench <seconds>        Measure NVML call and loop costs for 1, 4 and 8 GPUs, print JSON lines and exit\n");
+	printf("      --events                 Wait on NVML clock, Xid and power source events between samples\n");
+	printf("      --nvlink-groups          Move GPUs connected through NVLink between power states together\n");
+	printf("  -t, --threaded               Service each GPU from its own worker thread\n");
+	printf("  -w, --watchdog <ms>          Set the stall time to mark a GPU degraded (default: 5000)\n");
+	printf("      --metrics-listen <addr>  Serve Prometheus metrics on [host]:port (e.g. :9400)\n");
+	printf("  -c, --coder                  Enable encoder and decoder utilization\n");
+	printf("  -v, --verbose                Increase verbosity\n");
+}
+
+/* Long options without a short form */
+enum {
+	OPT_GPU_BOOST_CLOCK = 256,
+	OPT_GPU_LOW_POWER_CLOCK,
+	OPT_METRICS_LISTEN,
+	OPT_PREDICT,
+	OPT_CONTROL,
+	OPT_REPLAY,
+	OPT_RECORD,
+	OPT_POWER_BUDGET,
+	OPT_TEMP_MARGIN,
+	OPT_POLICY,
+	OPT_TARGET,
+	OPT_SMOOTHING,
+	OPT_PID,
+	OPT_CONFIG,
+	OPT_EVENTS,
+	OPT_MIG,
+	OPT_GPM,
+	OPT_LEARN,
+	OPT_LEARN_KEY,
+	OPT_NVLINK_GROUPS,
+	OPT_DRY_RUN,
+	OPT_HANDOFF,
+	OPT_CALIBRATE,
+	OPT_CALIBRATION,
+	OPT_MIN_INTERVAL,
+	OPT_MAX_INTERVAL,
+	OPT_BENCH
+};
+
+static std::atomic<bool> running(true);
+
+// Signal that stopped the main loop
+static std::atomic<int> stop_signal(0);
+
+void stopsig_handler(int sig) {
+	stop_signal = sig;
+	running = false;
+}
+
+static std::atomic<bool> reload_requested(false);
+
+void reload_handler(int sig) {
+	(void)sig;
+	reload_requested = true;
+}
+
+// Sleep until an absolute steady_clock deadline, returns early on signals
+void sleep_until(std::chrono::steady_clock::time_point deadline) {
+	// steady_clock is backed by CLOCK_MONOTONIC on Linux
+	long long ns = monotonic_ns(deadline);
+	struct timespec ts;
+	ts.tv_sec = ns / 1000000000LL;
+	ts.tv_nsec = ns % 1000000000LL;
+
+	// Never restarted by SA_RESTART, so a stop signal ends the wait at once
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+/* Sleeps in nvmlEventSetWait instead of the clock, so events from the
+ * watched GPUs end the wait early. Used from a single thread. */
+class EventWaiter {
+public:
+	// A wait returns after max_wait at the latest, NVML cannot be woken from another thread
+	explicit EventWaiter(unsigned int max_wait = 1000) : max_wait_ms(max_wait) {}
+
+	~EventWaiter() {
+		if(set) {
+			nvmlEventSetFree(set);
+		}
+	}
+
+	// False when no GPU could register, the caller sleeps instead
+	bool open(const std::vector<PowermizerInstance *> &candidates) {
+		nvmlReturn_t result = nvmlEventSetCreate(&set);
+		if(result != NVML_SUCCESS) {
+			log_printf(LOG_WARN, "Events: Failed to create event set, polling only: %s", nvmlErrorString(result));
+			set = nullptr;
+			return false;
+		}
+		for(PowermizerInstance *instance : candidates) {
+			if(instance->watch_events(set)) {
+				instances.push_back(instance);
+			}
+		}
+		return !instances.empty();
+	}
+
+	// Return once an event arrived or the deadline passed
+	void wait(std::chrono::steady_clock::time_point deadline) {
+		auto remaining = std::chrono::duration_cast<std::chrono::microseconds>(deadline - std::chrono::steady_clock::now());
+		if(remaining.count() <= 0) {
+			return;
+		}
+		// NVML does not return on signals, a bounded wait keeps stopping prompt
+		unsigned int timeout_ms = std::min((long long)(remaining.count() + 999) / 1000, (long long)max_wait_ms);
+		auto bounded = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+
+		nvmlEventData_t event;
+		nvmlReturn_t result = nvmlEventSetWait(set, &event, timeout_ms);
+		while(result == NVML_SUCCESS) {
+			dispatch(event);
+			// Take whatever else is queued without waiting
+			result = nvmlEventSetWait(set, &event, 0);
+		}
+		if(result != NVML_ERROR_TIMEOUT) {
+			if(!wait_failed) {
+				log_printf(LOG_WARN, "Events: Wait failed, sleeping instead: %s", nvmlErrorString(result));
+				wait_failed = true;
+			}
+			sleep_until(bounded);
+		}
+	}
+
+private:
+	unsigned int max_wait_ms;
+
+	void dispatch(const nvmlEventData_t &event) {
+		for(PowermizerInstance *instance : instances) {
+			if(instance->get_device()->has_handle(event.device)) {
+				instance->handle_event(event);
+				return;
+			}
+		}
+	}
+
+	nvmlEventSet_t set = nullptr;
+	std::vector<PowermizerInstance *> instances;
+	bool wait_failed = false;
+};
+
+// Service all instances from the calling thread
+void run_serial(std::vector<std::unique_ptr<PowermizerInstance>> &instances, unsigned int watchdog_ms, bool events,
+	const std::function<void()> &reload) {
+	EventWaiter waiter;
+	if(events) {
+		std::vector<PowermizerInstance *> candidates;
+		for(auto &instance : instances) {
+			candidates.push_back(instance.get());
+		}
+		events = waiter.open(candidates);
+	}
+
+	while(running) {
+		if(reload_requested.exchange(false)) {
+			reload();
+		}
+		auto now = std::chrono::steady_clock::now();
+		auto wakeup = std::chrono::steady_clock::time_point::max();
+		for(auto &instance : instances) {
+			if(instance->next_deadline() <= now) {
+				instance->process();
+				auto done = std::chrono::steady_clock::now();
+				instance->check_tick_time(done, std::chrono::duration_cast<std::chrono::milliseconds>(done - now).count(), watchdog_ms);
+				now = done;
+			}
+			wakeup = std::min(wakeup, instance->next_deadline());
+		}
+		if(events) {
+			waiter.wait(wakeup);
+		} else {
+			sleep_until(wakeup);
 		}
+	}
+}
 
-		// The return value seems to be arranged from max to min
-		// Push elements to vector
-		for(unsigned int i = 0; i < elements; i++) {
-			clocks.push_back(mem_clocks[i]);
-		}
-		max_power_state = elements - 1;
+static std::mutex stop_mutex;
+static std::condition_variable stop_cv;
 
-		log_printf(LOG_DEBUG, "GPU%d: Registered power states: %d", index, elements);
+/* Worker lifecycle, a worker left behind owns its instance from then on */
+typedef enum {
+	WORKER_RUNNING = 0,
+	WORKER_FINISHED,
+	WORKER_ABANDONED
+} WorkerState;
 
-		// Try to set to max power state
-		result = nvmlDeviceSetMemoryLockedClocks(device, clocks[0], clocks[0]);
-		if(result != NVML_SUCCESS) {
-			log_printf(LOG_ERROR, "GPU%d: Failed to manipulate clocks: %s", index, nvmlErrorString(result));
-			supported = false;
-			return;
+// Service one instance on its own schedule until stopped
+void run_worker(PowermizerInstance *instance, bool events, std::atomic<int> *state) {
+	// Each worker waits on its own event set, checking for a stop in between
+	static constexpr unsigned int stop_check_ms = 100;
+	EventWaiter waiter(stop_check_ms);
+	if(events) {
+		events = waiter.open({instance});
+	}
+
+	std::unique_lock<std::mutex> lock(stop_mutex);
+	while(running) {
+		lock.unlock();
+		if(instance->next_deadline() <= std::chrono::steady_clock::now()) {
+			instance->process();
+		}
+		if(events) {
+			waiter.wait(instance->next_deadline());
+			lock.lock();
+		} else {
+			lock.lock();
+			stop_cv.wait_until(lock, instance->next_deadline(), [] { return !running; });
 		}
+	}
+	lock.unlock();
+	int expected = WORKER_RUNNING;
+	if(!state->compare_exchange_strong(expected, WORKER_FINISHED)) {
+		// Given up on while stuck, nobody else touches the instance any more
+		log_printf(LOG_INFO, "GPU%d: Worker stopped late, resetting clocks", instance->get_index());
+		instance->reset_clocks();
+	}
+}
 
-		// Reset last update time
-		last_update = std::chrono::steady_clock::now();
+// Service each instance from a worker thread, the calling thread runs the watchdog.
+// NVML calls cannot be cancelled, so a device stuck in one is flagged and left behind.
+void run_threaded(std::vector<std::unique_ptr<PowermizerInstance>> &instances, unsigned int watchdog_ms, bool events,
+	const std::function<void()> &reload) {
+	std::vector<std::thread> workers;
+	std::unique_ptr<std::atomic<int>[]> states(new std::atomic<int>[instances.size()]);
 
-		log_printf(LOG_DEBUG, "GPU%d: Boost utilization: %d%%", index, boost_utilization);
-		log_printf(LOG_DEBUG, "GPU%d: Low power utilization: %d%%", index, low_power_utilization);
-		log_printf(LOG_DEBUG, "GPU%d: Boost time: %d ms", index, boost_activate_time);
-		log_printf(LOG_DEBUG, "GPU%d: Low power time: %d ms", index, low_power_activate_time);
-		log_printf(LOG_DEBUG, "GPU%d: Encoder and decoder utilization: %s", index, coder_enabled ? "enabled" : "disabled");
+	for(size_t i = 0; i < instances.size(); i++) {
+		states[i] = WORKER_RUNNING;
+		workers.push_back(start_thread(run_worker, instances[i].get(), events, &states[i]));
+	}
 
-		log_printf(LOG_INFO, "GPU%d: %s (%s) initialized", index, device_name, pci_info.busIdLegacy);
-	};
+	auto check_period = std::chrono::milliseconds(std::max(watchdog_ms / 4, 1U));
+	while(running) {
+		if(reload_requested.exchange(false)) {
+			reload();
+		}
+		auto now = std::chrono::steady_clock::now();
+		for(auto &instance : instances) {
+			instance->check_watchdog(now, watchdog_ms);
+		}
+		sleep_until(now + check_period);
+	}
 
-	~PowermizerInstance() {
-		if(supported) {
-			nvmlReturn_t result;
+	{
+		std::lock_guard<std::mutex> lock(stop_mutex);
+		stop_cv.notify_all();
+	}
 
-			// Reset control
-			log_printf(LOG_DEBUG, "GPU%d: Resetting memory clocks", index);
-			result = nvmlDeviceResetMemoryLockedClocks(device);
-			if(result != NVML_SUCCESS) {
-				log_printf(LOG_ERROR, "GPU%d: Failed to reset memory clocks: %s", index, nvmlErrorString(result));
-			}
+	// Give workers one watchdog period to finish their current tick
+	auto give_up = std::chrono::steady_clock::now() + std::chrono::milliseconds(watchdog_ms);
+	for(size_t i = 0; i < workers.size(); i++) {
+		while(states[i] == WORKER_RUNNING && std::chrono::steady_clock::now() < give_up) {
+			sleep_until(std::chrono::steady_clock::now() + std::chrono::milliseconds(10));
+		}
+		int expected = WORKER_RUNNING;
+		if(!states[i].compare_exchange_strong(expected, WORKER_ABANDONED)) {
+			workers[i].join();
+			continue;
 		}
-	};
 
-	bool is_supported() {
-		return supported;
+		// Still inside NVML, the instance must outlive the detached thread,
+		// which resets the clocks itself should the call return
+		log_printf(LOG_ERROR, "GPU%d: Worker did not stop, leaving its clocks to it", instances[i]->get_index());
+		workers[i].detach();
+		instances[i].release();
 	}
+	// Leaked on purpose, still referenced by detached workers
+	states.release();
+}
 
-	void process() {
-		nvmlReturn_t result;
-		nvmlUtilization_t utilization;
-		unsigned int encoder_utilization = 0;
-		unsigned int decoder_utilization = 0;
-		unsigned int sampling_period;
+// One JSON object with the distribution of a set of timings
+void print_bench_timings(const char *prefix, const char *what, std::vector<unsigned int> timings) {
+	if(timings.empty()) {
+		return;
+	}
+	std::sort(timings.begin(), timings.end());
+	auto percentile = [&](unsigned int p) {
+		size_t rank = (timings.size() * p + 99) / 100;
+		return timings[std::max(rank, (size_t)1) - 1];
+	};
+	printf("{%s,\"what\":\"%s\",\"count\":%zu,\"p50_us\":%u,\"p99_us\":%u,\"max_us\":%u}\n",
+		prefix, what, timings.size(), percentile(50), percentile(99), timings.back());
+}
 
-		// Get current time
-		auto now = std::chrono::steady_clock::now();
+// Run the first 1, 4 and 8 GPUs serially and threaded for a while each, and print
+// one JSON object per line: process() and NVML call timings per GPU, CPU time per tick
+bool run_bench(std::vector<std::unique_ptr<PowermizerInstance>> &instances, unsigned int seconds, unsigned int watchdog_ms,
+	bool events) {
+	static const unsigned int gpu_counts[] = {1, 4, 8};
+	auto no_reload = [] {};
 
-		// Get current GPU usage
-		result = nvmlDeviceGetUtilizationRates(device, &utilization);
-		if(result != NVML_SUCCESS) {
-			log_printf(LOG_ERROR, "GPU%d: Failed to get utilization: %s", index, nvmlErrorString(result));
-			return;
-		}
-		
-		if(en_de_coder_enabled) {
-			result = nvmlDeviceGetEncoderUtilization(device, &encoder_utilization, &sampling_period);
-			if(result != NVML_SUCCESS) {
-				log_printf(LOG_ERROR, "GPU%d: Failed to get encoder utilization: %s", index, nvmlErrorString(result));
-				encoder_utilization = 0;
+	for(unsigned int count : gpu_counts) {
+		for(int threaded = 0; threaded < 2 && running; threaded++) {
+			const char *mode = threaded ? "threaded" : "serial";
+			if(count > instances.size()) {
+				printf("{\"gpus\":%u,\"mode\":\"%s\",\"skipped\":\"%zu GPU(s) available\"}\n", count, mode, instances.size());
+				continue;
 			}
 
-			result = nvmlDeviceGetDecoderUtilization(device, &decoder_utilization, &sampling_period);
-			if(result != NVML_SUCCESS) {
-				log_printf(LOG_ERROR, "GPU%d: Failed to get decoder utilization: %s", index, nvmlErrorString(result));
-				decoder_utilization = 0;
+			std::vector<std::unique_ptr<PowermizerInstance>> subset;
+			unsigned long long ticks = 0;
+			for(unsigned int i = 0; i < count; i++) {
+				instances[i]->start_bench();
+				ticks -= instances[i]->get_metrics()->ticks.load();
+				subset.push_back(std::move(instances[i]));
 			}
-		}
-
-		max_utilization = std::max(utilization.gpu, std::max(encoder_utilization, decoder_utilization));
 
-		// Check if we need to change power state
-		// Boost condition
-		if(power_state > 0) {
-			if(max_utilization >= boost_utilization) {
-				// Check if time exceeded
-				auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(now - last_update);
-				if(duration.count() >= boost_activate_time) {
-					int new_clock = clocks[power_state - 1];
-					log_printf(LOG_DEBUG, "GPU%d: Boosting clock to %d", index, new_clock);
-					result = nvmlDeviceSetMemoryLockedClocks(device, new_clock, new_clock);
-					if(result != NVML_SUCCESS) {
-						log_printf(LOG_ERROR, "GPU%d: Failed to reset memory clocks: %s", index, nvmlErrorString(result));
-						return;
-					}
-					// Update update time
-					last_update = now;
-					power_state--;
+			// The loops run until stopped, a stop signal ends the whole benchmark
+			auto end = std::chrono::steady_clock::now() + std::chrono::seconds(seconds);
+			std::thread stopper = start_thread([end] {
+				while(running && std::chrono::steady_clock::now() < end) {
+					sleep_until(std::min(end, std::chrono::steady_clock::now() + std::chrono::milliseconds(10)));
 				}
-				// Action has pended or taken, stop processing
-				return;
+				std::lock_guard<std::mutex> lock(stop_mutex);
+				running = false;
+				stop_cv.notify_all();
+			});
+			struct timespec cpu_start, cpu_end;
+			clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_start);
+			auto started = std::chrono::steady_clock::now();
+			if(threaded) {
+				run_threaded(subset, watchdog_ms, events, no_reload);
+			} else {
+				run_serial(subset, watchdog_ms, events, no_reload);
 			}
-		}
+			double elapsed_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+			clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_end);
+			stopper.join();
 
-		// Low power condition
-		if(power_state < max_power_state) {
-			if(max_utilization <= low_power_utilization) {
-				// Check if time exceeded
-				auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(now - last_update);
-				if(duration.count() >= low_power_activate_time) {
-					int new_clock = clocks[power_state + 1];
-					log_printf(LOG_DEBUG, "GPU%d: Lowering clock to %d", index, new_clock);
-					result = nvmlDeviceSetMemoryLockedClocks(device, new_clock, new_clock);
-					if(result != NVML_SUCCESS) {
-						log_printf(LOG_ERROR, "GPU%d: Failed to set memory clocks: %s", index, nvmlErrorString(result));
-						return;
-					}
-					// Update update time
-					last_update = now;
-					power_state++;
+			bool stuck = false;
+			for(unsigned int i = 0; i < count; i++) {
+				instances[i] = std::move(subset[i]);
+				stuck = stuck || !instances[i];
+			}
+			if(stuck) {
+				return false;
+			}
+
+			char prefix[64];
+			for(unsigned int i = 0; i < count; i++) {
+				ticks += instances[i]->get_metrics()->ticks.load();
+				BenchSamples *samples = instances[i]->get_bench();
+				snprintf(prefix, sizeof(prefix), "\"gpus\":%u,\"mode\":\"%s\",\"gpu\":%d", count, mode, instances[i]->get_index());
+				print_bench_timings(prefix, "process", samples->process_us);
+				for(int call = 0; call < NVML_CALL_COUNT; call++) {
+					print_bench_timings(prefix, nvml_call_names[call], samples->call_us[call]);
 				}
-				// Action has pended or taken, stop processing
-				return;
 			}
-		}
+			double cpu_us = (cpu_end.tv_sec - cpu_start.tv_sec) * 1e6 + (cpu_end.tv_nsec - cpu_start.tv_nsec) / 1e3;
+			printf("{\"gpus\":%u,\"mode\":\"%s\",\"duration_s\":%.2f,\"ticks\":%llu,\"cpu_us_per_tick\":%.1f,\"cpu_share\":%.5f}\n",
+				count, mode, elapsed_s, ticks, ticks ? cpu_us / ticks : 0.0, cpu_us / 1e6 / elapsed_s);
+			fflush(stdout);
 
-		// No action has taken
-		// Update last update time
-		last_update = now;
+			// A stop signal during the run ends the benchmark
+			if(stop_signal != 0) {
+				return true;
+			}
+			running = true;
+		}
 	}
-
-private:
-	// Target device handle
-	nvmlDevice_t device;
-	int index;
-
-	// Config vars
-	bool en_de_coder_enabled;
-	unsigned int boost_utilization;
-	unsigned int low_power_utilization;
-	unsigned int boost_activate_time;
-	unsigned int low_power_activate_time;
-	std::vector<int> clocks = {};
-	bool supported = true;
-
-	// Process vars
-	int power_state = 0;
-	int max_power_state = 0;
-	unsigned int max_utilization;
-	std::chrono::steady_clock::time_point last_update;
-};
-
-void print_usage(const char *progname) {
-	printf("Usage: %s [options]\n", progname);
-	printf("Options:\n");
-	printf("  -h, --help                   Print this help message\n");
-	printf("  -b, --boost <util>           Set the utilization threshold to boost power state\n");
-	printf("  -l, --low-power <util>       Set the utilization threshold to lower power state\n");
-	printf("  -B, --boost-time <ms>        Set the time to boost power state\n");
-	printf("  -L, --low-power-time <ms>    Set the time to lower power state\n");
-	printf("  -c, --coder                  Enable encoder and decoder utilization\n");
-	printf("  -v, --verbose                Increase verbosity\n");
-}
-
-static bool running = true;
-
-void stopsig_handler(int sig) {
-	(void)sig;
-	running = false;
+	return true;
 }
 
 int main(int argc, char *argv[]) {
@@ -306,7 +5366,44 @@ int main(int argc, char *argv[]) {
 	int low_power_util = -1;
 	int boost_time = -1;
 	int low_power_time = -1;
+	int mem_boost_util = -1;
+	int mem_low_power_util = -1;
+	std::vector<unsigned int> mem_clocks;
+	bool gpu_clocks = false;
+	int gpu_boost_clock = 0;
+	int gpu_low_power_clock = 0;
+	int predict_time = 0;
+	const char *learn_path = NULL;
+	LearnKey learn_key = LEARN_KEY_NAME;
+	int interval = 100;
+	int min_interval = -1;
+	int max_interval = -1;
+	int watchdog = 5000;
+	bool threaded = false;
+	bool events = false;
+	bool nvlink_groups = false;
+	const char *metrics_listen = NULL;
+	const char *control_path = NULL;
+	const char *replay_source = NULL;
+	bool dry_run = false;
+	const char *handoff_path = NULL;
+	const char *calibrate_path = NULL;
+	int bench_seconds = 0;
+	const char *calibration_path = NULL;
+	const char *record_path = NULL;
+	const char *config_path = NULL;
+	int power_budget = 0;
+	ControlPolicy control_policy = POLICY_HYSTERESIS;
+	int target_util = 0;
+	int smoothing_time = 1000;
+	double pid_gains[3] = {4.0, 0.5, 0.0};
+	MigAggregate mig_aggregate = MIG_AGGREGATE_MAX;
+	bool gpm = false;
+	int temp_margin = 0;
 	bool coder_enabled = false;
+	BoostPolicy boost_policy = BOOST_STEP;
+	SampleStat sample_stat = SAMPLE_STAT_NONE;
+	unsigned int sample_percentile = 0;
 
 	int c;
 	int option_index = 0;
@@ -316,12 +5413,48 @@ int main(int argc, char *argv[]) {
 		{"low-power",       required_argument,  0, 'l'},
 		{"boost-time",      required_argument,  0, 'B'},
 		{"low-power-time",  required_argument,  0, 'L'},
+		{"mem-boost",       required_argument,  0, 'm'},
+		{"mem-low-power",   required_argument,  0, 'M'},
+		{"mem-clocks",      required_argument,  0, 'C'},
+		{"gpu-clocks",      no_argument,        0, 'g'},
+		{"gpu-boost-clock", required_argument,  0, OPT_GPU_BOOST_CLOCK},
+		{"gpu-low-power-clock", required_argument, 0, OPT_GPU_LOW_POWER_CLOCK},
+		{"boost-policy",    required_argument,  0, 'p'},
+		{"samples",         required_argument,  0, 's'},
+		{"interval",        required_argument,  0, 'i'},
+		{"min-interval",    required_argument,  0, OPT_MIN_INTERVAL},
+		{"max-interval",    required_argument,  0, OPT_MAX_INTERVAL},
+		{"predict",         required_argument,  0, OPT_PREDICT},
+		{"learn",           required_argument,  0, OPT_LEARN},
+		{"learn-key",       required_argument,  0, OPT_LEARN_KEY},
+		{"control",         required_argument,  0, OPT_CONTROL},
+		{"replay",          required_argument,  0, OPT_REPLAY},
+		{"dry-run",         no_argument,        0, OPT_DRY_RUN},
+		{"handoff",         required_argument,  0, OPT_HANDOFF},
+		{"calibrate",       required_argument,  0, OPT_CALIBRATE},
+		{"bench",           required_argument,  0, OPT_BENCH},
+		{"calibration",     required_argument,  0, OPT_CALIBRATION},
+		{"record",          required_argument,  0, OPT_RECORD},
+		{"power-budget",    required_argument,  0, OPT_POWER_BUDGET},
+		{"temp-margin",     required_argument,  0, OPT_TEMP_MARGIN},
+		{"policy",          required_argument,  0, OPT_POLICY},
+		{"target",          required_argument,  0, OPT_TARGET},
+		{"smoothing",       required_argument,  0, OPT_SMOOTHING},
+		{"pid",             required_argument,  0, OPT_PID},
+		{"config",          required_argument,  0, OPT_CONFIG},
+		{"mig",             required_argument,  0, OPT_MIG},
+		{"gpm",             no_argument,        0, OPT_GPM},
+		{"events",          no_argument,        0, OPT_EVENTS},
+		{"nvlink-groups",   no_argument,        0, OPT_NVLINK_GROUPS},
+		{"threaded",        no_argument,        0, 't'},
+		{"watchdog",        required_argument,  0, 'w'},
+		{"metrics-listen",  required_argument,  0, OPT_METRICS_LISTEN},
 		{"coder",           no_argument,        0, 'c'},
 		{"verbose",         no_argument,        0, 'v'},
 		{0, 0, 0, 0}
 	};
 
-	while((c = getopt_long(argc, argv, "hb:l:B:L:cv", long_options, &option_index)) != -1) {
+	while((c = getopt_long(argc, argv, "hb:l:B:L:m:M:C:gp:s:i:tw:cv", long_options, &option_index)) != -1) {
 		switch(c) {
 			case 'h':
 				print_usage(argv[0]);
@@ -338,6 +5471,147 @@ int main(int argc, char *argv[]) {
 			case 'L':
 				low_power_time = atoi(optarg);
 				break;
+			case 'm':
+				mem_boost_util = atoi(optarg);
+				break;
+			case 'M':
+				mem_low_power_util = atoi(optarg);
+				break;
+			case 'C':
+				if(!parse_clock_list(optarg, mem_clocks)) {
+					printf("Error: Invalid memory clock list: %s\n", optarg);
+					print_usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 'g':
+				gpu_clocks = true;
+				break;
+			case OPT_GPU_BOOST_CLOCK:
+				gpu_boost_clock = atoi(optarg);
+				break;
+			case OPT_GPU_LOW_POWER_CLOCK:
+				gpu_low_power_clock = atoi(optarg);
+				break;
+			case 'p':
+				if(!parse_boost_policy(optarg, &boost_policy)) {
+					printf("Error: Unknown boost policy: %s\n", optarg);
+					print_usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 's':
+				if(!parse_sample_stat(optarg, &sample_stat, &sample_percentile)) {
+					printf("Error: Unknown sample statistic: %s\n", optarg);
+					print_usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 'i':
+				interval = atoi(optarg);
+				break;
+			case OPT_MIN_INTERVAL:
+				min_interval = atoi(optarg);
+				break;
+			case OPT_MAX_INTERVAL:
+				max_interval = atoi(optarg);
+				break;
+			case OPT_PREDICT:
+				predict_time = atoi(optarg);
+				break;
+			case OPT_LEARN:
+				learn_path = optarg;
+				break;
+			case OPT_LEARN_KEY:
+				if(!parse_learn_key(optarg, &learn_key)) {
+					printf("Error: Unknown learn key: %s\n", optarg);
+					print_usage(argv[0]);
+					return 1;
+				}
+				break;
+			case OPT_CONTROL:
+				control_path = optarg;
+				break;
+			case OPT_REPLAY:
+				replay_source = optarg;
+				break;
+			case OPT_DRY_RUN:
+				dry_run = true;
+				break;
+			case OPT_HANDOFF:
+				handoff_path = optarg;
+				break;
+			case OPT_CALIBRATE:
+				calibrate_path = optarg;
+				break;
+			case OPT_BENCH:
+				bench_seconds = atoi(optarg);
+				if(bench_seconds <= 0) {
+					printf("Error: Benchmark time must be positive\n");
+					print_usage(argv[0]);
+					return 1;
+				}
+				break;
+			case OPT_CALIBRATION:
+				calibration_path = optarg;
+				break;
+			case OPT_RECORD:
+				record_path = optarg;
+				break;
+			case OPT_POWER_BUDGET:
+				power_budget = atoi(optarg);
+				break;
+			case OPT_TEMP_MARGIN:
+				temp_margin = atoi(optarg);
+				break;
+			case OPT_POLICY:
+				if(!parse_control_policy(optarg, &control_policy)) {
+					printf("Error: Unknown control policy: %s\n", optarg);
+					print_usage(argv[0]);
+					return 1;
+				}
+				break;
+			case OPT_CONFIG:
+				config_path = optarg;
+				break;
+			case OPT_TARGET:
+				target_util = atoi(optarg);
+				break;
+			case OPT_SMOOTHING:
+				smoothing_time = atoi(optarg);
+				break;
+			case OPT_PID:
+				if(!parse_pid_gains(optarg, pid_gains)) {
+					printf("Error: Invalid PID gains: %s\n", optarg);
+					print_usage(argv[0]);
+					return 1;
+				}
+				break;
+			case OPT_MIG:
+				if(!parse_mig_aggregate(optarg, &mig_aggregate)) {
+					printf("Error: Unknown MIG aggregation: %s\n", optarg);
+					print_usage(argv[0]);
+					return 1;
+				}
+				break;
+			case OPT_GPM:
+				gpm = true;
+				break;
+			case OPT_NVLINK_GROUPS:
+				nvlink_groups = true;
+				break;
+			case OPT_EVENTS:
+				events = true;
+				break;
+			case 't':
+				threaded = true;
+				break;
+			case 'w':
+				watchdog = atoi(optarg);
+				break;
+			case OPT_METRICS_LISTEN:
+				metrics_listen = optarg;
+				break;
 			case 'c':
 				coder_enabled = true;
 				break;
@@ -350,33 +5624,112 @@ int main(int argc, char *argv[]) {
 		}
 	}
 	
-	if(boost_util == -1) {
+	// A config file may provide them per GPU instead
+	if(boost_util == -1 && !config_path) {
 		printf("Error: Boost utilization threshold is not set\n");
 		print_usage(argv[0]);
 		return 1;
 	}
-	if(low_power_util == -1) {
+	if(low_power_util == -1 && !config_path) {
 		printf("Error: Low power utilization threshold is not set\n");
 		print_usage(argv[0]);
 		return 1;
 	}
-	if(boost_time == -1) {
+	if(boost_time == -1 && !config_path) {
 		printf("Error: Boost time is not set\n");
 		print_usage(argv[0]);
 		return 1;
 	}
-	if(low_power_time == -1) {
+	if(low_power_time == -1 && !config_path) {
 		printf("Error: Low power time is not set\n");
 		print_usage(argv[0]);
 		return 1;
 	}
+	if((mem_boost_util == -1) != (mem_low_power_util == -1)) {
+		printf("Error: Memory utilization thresholds must be set together\n");
+		print_usage(argv[0]);
+		return 1;
+	}
+	if(interval <= 0) {
+		printf("Error: Sampling interval must be positive\n");
+		print_usage(argv[0]);
+		return 1;
+	}
+	min_interval = min_interval != -1 ? min_interval : std::min(interval, max_interval != -1 ? max_interval : interval);
+	max_interval = max_interval != -1 ? max_interval : std::max(interval, min_interval);
+	if(min_interval <= 0 || max_interval < min_interval) {
+		printf("Error: Minimum interval must be positive and not above the maximum interval\n");
+		print_usage(argv[0]);
+		return 1;
+	}
+	interval = std::min(std::max(interval, min_interval), max_interval);
+	if(watchdog <= 0) {
+		printf("Error: Watchdog time must be positive\n");
+		print_usage(argv[0]);
+		return 1;
+	}
+	if(target_util < 0 || target_util > 100) {
+		printf("Error: Target utilization must be between 0 and 100\n");
+		print_usage(argv[0]);
+		return 1;
+	}
+	if(smoothing_time <= 0) {
+		printf("Error: Smoothing time must be positive\n");
+		print_usage(argv[0]);
+		return 1;
+	}
+	if(power_budget < 0 || temp_margin < 0) {
+		printf("Error: Power budget and temperature margin must not be negative\n");
+		print_usage(argv[0]);
+		return 1;
+	}
 
 	if(verbose > 0) {
 		current_loglevel = LOG_DEBUG;
+	} else if(bench_seconds > 0) {
+		// Keep stdout to the results
+		current_loglevel = LOG_WARN;
 	}
 
 	log_printf(LOG_INFO, "NVIDIA Powermizer " VERSION " starting");
 
+	PowermizerConfig config;
+	config.en_de_coder_enabled = coder_enabled;
+	config.boost_utilization = boost_util != -1 ? boost_util : SETTING_UNSET;
+	config.low_power_utilization = low_power_util != -1 ? low_power_util : SETTING_UNSET;
+	config.boost_activate_time = boost_time != -1 ? boost_time : SETTING_UNSET;
+	config.low_power_activate_time = low_power_time != -1 ? low_power_time : SETTING_UNSET;
+	config.mem_enabled = mem_boost_util != -1;
+	config.mem_boost_utilization = mem_boost_util;
+	config.mem_low_power_utilization = mem_low_power_util;
+	config.boost_policy = boost_policy;
+	config.control_policy = control_policy;
+	config.target_utilization = target_util;
+	config.smoothing_time = smoothing_time;
+	std::copy(pid_gains, pid_gains + 3, config.pid_gains);
+	config.mig_aggregate = mig_aggregate;
+	config.gpm_enabled = gpm;
+	config.predict_grace_time = std::max(predict_time, 0);
+	config.mem_clocks = mem_clocks;
+	config.gpu_clocks_enabled = gpu_clocks;
+	config.gpu_boost_clock = std::max(gpu_boost_clock, 0);
+	config.gpu_low_power_clock = std::max(gpu_low_power_clock, 0);
+	config.sample_stat = sample_stat;
+	config.sample_percentile = sample_percentile;
+
+	ProfileSet profiles;
+	if(config_path) {
+		if(!profiles.load(config_path)) {
+			return 1;
+		}
+		log_printf(LOG_INFO, "Config: Loaded %s", config_path);
+	}
+
+	// Offline policy evaluation, no GPU involved
+	if(replay_source) {
+		return run_replay(replay_source, config, interval, min_interval, max_interval, config_path ? &profiles : nullptr);
+	}
+
 	// Initialize NVML
 	log_printf(LOG_DEBUG, "Initializing NVML");
 	nvmlReturn_t result;
@@ -412,46 +5765,204 @@ int main(int argc, char *argv[]) {
 
 	log_printf(LOG_INFO, "Found %d GPU(s)", device_count);
 
+	WorkloadCache workload_cache;
+	if(learn_path && !workload_cache.load(learn_path, learn_key)) {
+		return 1;
+	}
+
 	log_printf(LOG_INFO, "Initializing GPU(s)");
-	std::vector<std::unique_ptr<PowermizerInstance>> instances;
-	for(unsigned int i = 0; i < device_count; i++) {
-		auto instance = std::make_unique<PowermizerInstance>(i, coder_enabled, boost_util, low_power_util, boost_time, low_power_time);
-		if(!instance->is_supported()) {
-			log_printf(LOG_WARN, "GPU%d: Not supported", i);
-			continue;
-		}
-		instances.push_back(std::move(instance));
+	if(dry_run) {
+		log_printf(LOG_INFO, "Dry run, clocks are left to the driver");
+	}
+	HandoffState handoff;
+	if(handoff_path && dry_run) {
+		// The handoff belongs to the next run that actually owns the clocks
+		log_printf(LOG_INFO, "Dry run, leaving handoff file %s in place", handoff_path);
+	} else if(handoff_path && !handoff.load(handoff_path)) {
+		return 1;
 	}
+	auto instances = create_instances(device_count, config, config_path ? &profiles : nullptr, &handoff, dry_run);
 	
 	if(instances.size() == 0) {
 		log_printf(LOG_FATAL, "No supported GPU found");
 		return 1;
 	}
 
-	// Determine loop interval
-	int loop_interval_us = std::min(boost_time, low_power_time) * 1000;
-	log_printf(LOG_DEBUG, "Loop interval: %d us", loop_interval_us);
+	// Measure the transitions one GPU at a time, then hand the clocks back
+	if(calibrate_path) {
+		if(dry_run) {
+			log_printf(LOG_FATAL, "Calibration needs real clock changes, not a dry run");
+			return 1;
+		}
+		CalibrationTable table;
+		if(!table.load(calibrate_path, true)) {
+			return 1;
+		}
+		bool calibrated = true;
+		for(auto &instance : instances) {
+			calibrated = instance->calibrate(table) && calibrated;
+		}
+		instances.clear();
+		if(!calibrated || !table.save(calibrate_path)) {
+			return 1;
+		}
+		nvmlShutdown();
+		return 0;
+	}
+
+	if(calibration_path) {
+		CalibrationTable table;
+		if(!table.load(calibration_path, false)) {
+			return 1;
+		}
+		for(auto &instance : instances) {
+			instance->apply_calibration(table);
+		}
+	}
+
+	form_groups(instances, nvlink_groups);
+
+	// Sampling is decoupled from the hysteresis windows, each instance
+	// additionally wakes the loop when a pending transition falls due
+	log_printf(LOG_DEBUG, "Sampling interval: %d ms, between %d and %d ms", interval, min_interval, max_interval);
+	for(auto &instance : instances) {
+		instance->set_sampling_period(interval);
+		instance->set_sampling_range(min_interval, max_interval);
+		// One reading serves the trace, the metrics and the budget, every sample only for the trace
+		instance->set_power_sampling(record_path || metrics_listen || power_budget > 0, record_path ? 0 : Governor::period_ms);
+		if(learn_path) {
+			instance->set_workload_cache(&workload_cache);
+		}
+	}
+
+	MetricsServer metrics_server;
+	if(metrics_listen) {
+		for(auto &instance : instances) {
+			metrics_server.add(instance->get_metrics());
+		}
+		if(!metrics_server.start(metrics_listen)) {
+			return 1;
+		}
+	}
+
+	ControlServer control_server;
+	if(control_path && !control_server.start(control_path, instances)) {
+		return 1;
+	}
+
+	TraceRecorder recorder;
+	if(record_path) {
+		if(!recorder.open(record_path)) {
+			return 1;
+		}
+		for(auto &instance : instances) {
+			instance->set_record_channel(recorder.add_channel());
+		}
+		recorder.start();
+	}
+
+	std::unique_ptr<Governor> governor;
+	if(power_budget > 0 || temp_margin > 0) {
+		governor = std::make_unique<Governor>(instances, power_budget, temp_margin, record_path || metrics_listen);
+		governor->start();
+	}
 
 	// Set signal handler
 	log_printf(LOG_DEBUG, "Setting signal handler");
 	signal(SIGINT, stopsig_handler);
 	signal(SIGTERM, stopsig_handler);
+	signal(SIGHUP, reload_handler);
+
+	// Profiles are reread on SIGHUP, clocks stay as they are.
+	// Learnt workloads are saved then as well, not only on exit.
+	auto reload = [&]() {
+		if(learn_path) {
+			workload_cache.save();
+		}
+		if(!config_path) {
+			log_printf(LOG_INFO, "No config file to reload");
+			return;
+		}
+		if(!profiles.load(config_path)) {
+			log_printf(LOG_ERROR, "Config: Reload failed, keeping current settings");
+			return;
+		}
+		log_printf(LOG_INFO, "Config: Reloaded %s", config_path);
+		for(auto &instance : instances) {
+			instance->reload_profiles(config, profiles);
+		}
+	};
+
+	// Log writes leave the sampling path from here on
+	AsyncLogger async_logger;
+	async_logger.start();
 
 	log_printf(LOG_INFO, "Powermizer started");
+	auto started = std::chrono::steady_clock::now();
 
 	// Main loop
-	while(running) {
-		for(auto &instance : instances) {
-			instance->process();
+	if(bench_seconds > 0) {
+		printf("{\"version\":\"%s\",\"nvml\":\"%s\",\"driver\":\"%s\",\"interval_ms\":%d,\"seconds\":%d}\n",
+			VERSION, nvml_version_str, driver_version_str, interval, bench_seconds);
+		if(!run_bench(instances, bench_seconds, watchdog, events)) {
+			log_printf(LOG_ERROR, "Benchmark aborted, a GPU got stuck");
 		}
-		usleep(loop_interval_us);
+	} else if(threaded) {
+		log_printf(LOG_DEBUG, "Threaded mode, watchdog: %d ms", watchdog);
+		run_threaded(instances, watchdog, events, reload);
+	} else {
+		run_serial(instances, watchdog, events, reload);
 	}
 
 	log_printf(LOG_INFO, "Exiting");
+	metrics_server.stop();
+	control_server.stop();
+	recorder.stop();
+	if(governor) {
+		governor->stop();
+	}
+
+	// On SIGTERM, e.g. a restart or upgrade, the next run takes over the
+	// locked clocks instead of going through the driver default and back
+	if(handoff_path && stop_signal == SIGTERM && !dry_run) {
+		HandoffState handed;
+		for(auto &instance : instances) {
+			HandoffEntry entry;
+			if(instance && instance->hand_off(&entry)) {
+				handed.put(instance->get_uuid(), entry);
+			}
+		}
+		handed.save(handoff_path);
+	}
 
+	double run_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+	bool workers_stuck = false;
 	for(auto &instance : instances) {
+		if(dry_run && instance) {
+			report_dry_run(*instance, run_s);
+		}
+		auto m = instance ? instance->get_metrics() : nullptr;
+		if(m && m->ticks.load() > 0) {
+			log_printf(LOG_DEBUG, "GPU%d: %.2f NVML calls per tick over %llu ticks, %.2f saved by shared readings",
+				m->index, (double)m->nvml_calls.load() / m->ticks.load(), m->ticks.load(),
+				(double)m->nvml_calls_saved.load() / m->ticks.load());
+		}
+		if(!instance) {
+			workers_stuck = true;
+		}
 		instance.reset();
 	}
+	// Workloads still running were learnt as instances went away
+	if(learn_path) {
+		workload_cache.save();
+	}
+	async_logger.stop();
+
+	// A stuck worker is still inside the library
+	if(workers_stuck) {
+		log_printf(LOG_WARN, "Skipping NVML shutdown, worker(s) still busy");
+		return 1;
+	}
 
 	// Shutdown NVML
 	log_printf(LOG_DEBUG, "Shutting down NVML");